@@ -0,0 +1,463 @@
+/*
+ * Sector cache for spisd.device
+ */
+
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/lists.h>
+
+#include <proto/exec.h>
+#include <proto/alib.h>
+
+#include "common.h"
+#include "sd.h"
+#include "cache.h"
+
+#define CACHE_NO_SECTOR		0xfffffffful
+
+/* Little endian fields of the MBR and FAT boot sector */
+#define LE16(p)				((uint16_t)(p)[0] | ((uint16_t)(p)[1] << 8))
+#define LE32(p)				((uint32_t)LE16(p) | ((uint32_t)LE16((p) + 2) << 16))
+
+#define MAX_VOLUMES			4
+
+typedef struct cache_entry {
+	struct MinNode		node;				/* LRU list link, most recently used at the head */
+	struct cache_entry	*hash_next;
+	uint32_t			sector;				/* CACHE_NO_SECTOR if unused */
+	bool				meta;				/* on the metadata list */
+	bool				dirty;				/* written by cache_write() and not yet on the card */
+	uint8_t				*data;
+} cache_entry_t;
+
+/* Metadata area of a FAT volume: boot sector, reserved sectors, FATs and
+ * (FAT12/16) the root directory, which are contiguous from the volume start */
+typedef struct {
+	uint32_t			start;
+	uint32_t			end;				/* 0 until the boot sector has been seen */
+} cache_volume_t;
+
+static cache_entry_t *entries;
+static cache_entry_t **hash;
+static uint8_t *pool;
+static uint32_t num_entries;
+static uint32_t hash_size;
+static struct MinList lru_data;				/* unused entries sit at the tail */
+static struct MinList lru_meta;
+static uint32_t num_meta, max_meta;
+static uint32_t num_dirty, max_dirty;
+static cache_entry_t **flush_list;			/* cache_flush() work space */
+static sd_segment_t *flush_seg;
+
+static cache_volume_t volumes[MAX_VOLUMES];
+static unsigned int num_volumes;
+
+static cache_entry_t *cache_lookup(uint32_t sector)
+{
+	cache_entry_t *e;
+
+	for (e = hash[sector & (hash_size - 1)]; e; e = e->hash_next) {
+		if (e->sector == sector) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void cache_unhash(cache_entry_t *e)
+{
+	cache_entry_t **p;
+
+	for (p = &hash[e->sector & (hash_size - 1)]; *p; p = &(*p)->hash_next) {
+		if (*p == e) {
+			*p = e->hash_next;
+			break;
+		}
+	}
+	e->sector = CACHE_NO_SECTOR;
+}
+
+/*! Moves an entry to the head of its LRU list */
+static void cache_touch(cache_entry_t *e)
+{
+	Remove((struct Node*)&e->node);
+	AddHead((struct List*)(e->meta ? &lru_meta : &lru_data), (struct Node*)&e->node);
+}
+
+static void cache_set_meta(cache_entry_t *e, bool meta)
+{
+	if (e->meta != meta) {
+		e->meta = meta;
+		num_meta += meta ? 1 : -1;
+	}
+}
+
+static bool cache_is_meta(uint32_t sector)
+{
+	unsigned int n;
+
+	for (n = 0; n < num_volumes; n++) {
+		if (sector == volumes[n].start || (sector > volumes[n].start && sector < volumes[n].end)) {
+			return true;
+		}
+	}
+	return sector == 0;
+}
+
+/*! Returns the least recently used entry of a list that can be recycled */
+static cache_entry_t *cache_clean_tail(struct MinList *list)
+{
+	struct MinNode *n;
+
+	for (n = list->mlh_TailPred; n->mln_Pred; n = n->mln_Pred) {
+		if (!((cache_entry_t*)n)->dirty) {
+			return (cache_entry_t*)n;
+		}
+	}
+	return NULL;
+}
+
+/*! Picks the entry to recycle. Metadata only displaces file data while it
+ * is below max_meta, and file data never displaces metadata. Dirty entries
+ * are never recycled. NULL is returned if there is no entry to recycle,
+ * the sector is then not cached. */
+static cache_entry_t *cache_victim(bool meta)
+{
+	cache_entry_t *d = cache_clean_tail(&lru_data);
+	cache_entry_t *m;
+
+	if (!meta) {
+		return d;
+	}
+	m = cache_clean_tail(&lru_meta);
+	if (d == NULL) {
+		return m;
+	}
+	if (m == NULL) {
+		return d;
+	}
+	return num_meta >= max_meta ? m : d;
+}
+
+/*! Finds or allocates the entry for a sector, NULL if it is not to be cached */
+static cache_entry_t *cache_get(uint32_t sector, bool meta, bool insert)
+{
+	cache_entry_t *e = cache_lookup(sector);
+
+	if (e == NULL && insert) {
+		/* Recycle the least recently used entry */
+		if ((e = cache_victim(meta)) == NULL) {
+			return NULL;
+		}
+		if (e->sector != CACHE_NO_SECTOR) {
+			cache_unhash(e);
+		}
+		e->sector = sector;
+		e->hash_next = hash[sector & (hash_size - 1)];
+		hash[sector & (hash_size - 1)] = e;
+	}
+	if (e) {
+		/* Metadata beyond max_meta, with no metadata entry to recycle, is kept as file data */
+		cache_set_meta(e, meta && (e->meta || num_meta < max_meta));
+		cache_touch(e);
+	}
+	return e;
+}
+
+static void cache_set_dirty(cache_entry_t *e, bool dirty)
+{
+	if (e->dirty != dirty) {
+		e->dirty = dirty;
+		num_dirty += dirty ? 1 : -1;
+	}
+}
+
+/*! Locates the FAT metadata area of volumes from the MBR and boot sectors */
+static void cache_parse_boot(const uint8_t *buf, uint32_t sector)
+{
+	const uint8_t *p;
+	uint32_t fat_size, root_sectors;
+	unsigned int n;
+
+	if (buf[510] != 0x55 || buf[511] != 0xaa) {
+		return;
+	}
+
+	/* FAT boot sector: 512 byte sectors, power of 2 cluster size, 1 or 2 FATs */
+	fat_size = LE16(buf + 22) ? (uint32_t)LE16(buf + 22) : LE32(buf + 36);
+	if (LE16(buf + 11) == SD_SECTOR_SIZE && buf[13] && !(buf[13] & (buf[13] - 1)) &&
+			LE16(buf + 14) && (buf[16] == 1 || buf[16] == 2) && fat_size) {
+		root_sectors = (LE16(buf + 17) * 32 + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+		for (n = 0; n < num_volumes && volumes[n].start != sector; n++);
+		if (n == num_volumes) {
+			if (num_volumes == MAX_VOLUMES) {
+				return;
+			}
+			volumes[num_volumes++].start = sector;
+		}
+		volumes[n].end = sector + LE16(buf + 14) + buf[16] * fat_size + root_sectors;
+		INFO("FAT metadata %lu-%lu\n", volumes[n].start, volumes[n].end - 1);
+		return;
+	}
+
+	/* MBR: remember where the FAT partitions start, their boot sectors come later */
+	if (sector == 0 && num_volumes == 0) {
+		for (p = buf + 446; p < buf + 510 && num_volumes < MAX_VOLUMES; p += 16) {
+			switch (p[4]) {
+				case 0x01: case 0x04: case 0x06: case 0x0b: case 0x0c: case 0x0e:
+					volumes[num_volumes].start = LE32(p + 8);
+					volumes[num_volumes].end = 0;
+					num_volumes++;
+					break;
+			}
+		}
+	}
+}
+
+int cache_init(uint32_t kbytes)
+{
+	uint32_t n;
+
+	cache_shutdown();
+
+	num_entries = kbytes * 1024 / SD_SECTOR_SIZE;
+	if (num_entries == 0) {
+		return 0;
+	}
+	for (hash_size = 1; hash_size < num_entries; hash_size <<= 1);
+
+	entries = AllocMem(num_entries * sizeof(cache_entry_t), MEMF_PUBLIC | MEMF_CLEAR);
+	hash = AllocMem(hash_size * sizeof(cache_entry_t*), MEMF_PUBLIC | MEMF_CLEAR);
+	pool = AllocMem(num_entries * SD_SECTOR_SIZE, MEMF_PUBLIC);
+	flush_list = AllocMem(num_entries * sizeof(cache_entry_t*), MEMF_PUBLIC);
+	flush_seg = AllocMem(num_entries * sizeof(sd_segment_t), MEMF_PUBLIC);
+	if (entries == NULL || hash == NULL || pool == NULL || flush_list == NULL || flush_seg == NULL) {
+		ERROR("Cache allocation failed\n");
+		cache_shutdown();
+		return -1;
+	}
+
+	NewList((struct List*)&lru_data);
+	NewList((struct List*)&lru_meta);
+	for (n = 0; n < num_entries; n++) {
+		entries[n].sector = CACHE_NO_SECTOR;
+		entries[n].data = pool + n * SD_SECTOR_SIZE;
+		AddTail((struct List*)&lru_data, (struct Node*)&entries[n].node);
+	}
+	num_meta = 0;
+	max_meta = num_entries * CACHE_META_PERCENT / 100;
+	num_dirty = 0;
+	max_dirty = num_entries * CACHE_DIRTY_PERCENT / 100;
+	num_volumes = 0;
+
+	INFO("Cache %lu sectors\n", num_entries);
+	return 0;
+}
+
+void cache_shutdown(void)
+{
+	if (entries) {
+		FreeMem(entries, num_entries * sizeof(cache_entry_t));
+		entries = NULL;
+	}
+	if (hash) {
+		FreeMem(hash, hash_size * sizeof(cache_entry_t*));
+		hash = NULL;
+	}
+	if (pool) {
+		FreeMem(pool, num_entries * SD_SECTOR_SIZE);
+		pool = NULL;
+	}
+	if (flush_list) {
+		FreeMem(flush_list, num_entries * sizeof(cache_entry_t*));
+		flush_list = NULL;
+	}
+	if (flush_seg) {
+		FreeMem(flush_seg, num_entries * sizeof(sd_segment_t));
+		flush_seg = NULL;
+	}
+	num_entries = 0;
+}
+
+/*! Copies count sectors to buf if all of them are cached, otherwise returns false */
+bool cache_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	cache_entry_t *e;
+	uint32_t n;
+
+	if (num_entries == 0) {
+		return false;
+	}
+	for (n = 0; n < count; n++) {
+		if (cache_lookup(sector + n) == NULL) {
+			return false;
+		}
+	}
+	for (n = 0; n < count; n++, buf += SD_SECTOR_SIZE) {
+		e = cache_lookup(sector + n);
+		CopyMem(e->data, buf, SD_SECTOR_SIZE);
+		cache_touch(e);
+	}
+	return true;
+}
+
+/*! Records sectors just read from the card. Sectors with unwritten changes
+ * in the cache are newer than the card, they are copied over buf instead. */
+void cache_store(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	cache_entry_t *e;
+	uint32_t n;
+	bool meta;
+
+	if (num_entries == 0) {
+		return;
+	}
+	for (n = 0; n < count; n++, buf += SD_SECTOR_SIZE) {
+		meta = cache_is_meta(sector + n);
+		e = cache_get(sector + n, meta, count <= CACHE_MAX_RUN || meta);
+		if (e && e->dirty) {
+			CopyMem(e->data, buf, SD_SECTOR_SIZE);
+			continue;
+		}
+		if (meta) {
+			cache_parse_boot(buf, sector + n);
+		}
+		if (e) {
+			CopyMem(buf, e->data, SD_SECTOR_SIZE);
+		}
+	}
+}
+
+/*! Records sectors written to the card (dirty false), or holds them to be
+ * written later by cache_flush() (dirty true). Holding fails, and nothing is
+ * changed, if the request is longer than CACHE_MAX_RUN or the dirty sectors
+ * cannot be kept within CACHE_DIRTY_PERCENT; the caller writes to the card.
+ * It also fails if no entry is left for file data even after a flush, the
+ * sectors held before then are overwritten by the caller's write. */
+bool cache_write(const uint8_t *buf, uint32_t sector, uint32_t count, bool dirty)
+{
+	cache_entry_t *e;
+	uint32_t n;
+	bool meta;
+
+	if (num_entries == 0) {
+		return !dirty;
+	}
+	if (dirty) {
+		if (count > CACHE_MAX_RUN || count > max_dirty) {
+			return false;
+		}
+		if (num_dirty + count > max_dirty && cache_flush() < 0) {
+			return false;
+		}
+	}
+	for (n = 0; n < count; n++, buf += SD_SECTOR_SIZE) {
+		meta = cache_is_meta(sector + n);
+		if (meta) {
+			cache_parse_boot(buf, sector + n);
+		}
+		e = cache_get(sector + n, meta, dirty || count <= CACHE_MAX_RUN || meta);
+		if (e == NULL && dirty && cache_flush() == 0) {
+			/* The clean entries all held metadata, the flush freed file data entries */
+			e = cache_get(sector + n, meta, true);
+		}
+		if (e) {
+			CopyMem((APTR)buf, e->data, SD_SECTOR_SIZE);
+			cache_set_dirty(e, dirty);
+		} else if (dirty) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*! Sorts entries by sector (Shell sort, no recursion on the small task stack) */
+static void cache_sort(cache_entry_t **list, uint32_t n)
+{
+	cache_entry_t *e;
+	uint32_t gap, i, j;
+
+	for (gap = n / 2; gap; gap /= 2) {
+		for (i = gap; i < n; i++) {
+			e = list[i];
+			for (j = i; j >= gap && list[j - gap]->sector > e->sector; j -= gap) {
+				list[j] = list[j - gap];
+			}
+			list[j] = e;
+		}
+	}
+}
+
+/*! Writes all dirty sectors to the card, each run of consecutive sectors as
+ * one multiple-block write, and closes the transfer */
+int cache_flush(void)
+{
+	uint32_t n = 0, i, j, run;
+	int err = 0;
+
+	if (num_dirty == 0) {
+		return 0;
+	}
+	for (i = 0; i < num_entries; i++) {
+		if (entries[i].dirty) {
+			flush_list[n++] = &entries[i];
+		}
+	}
+	cache_sort(flush_list, n);
+
+	for (i = 0; i < n; i += run) {
+		for (run = 0; i + run < n && flush_list[i + run]->sector == flush_list[i]->sector + run; run++) {
+			flush_seg[run].buf = flush_list[i + run]->data;
+			flush_seg[run].count = 1;
+		}
+		if (sd_write_segments(flush_list[i]->sector, flush_seg, run) < 0) {
+			/* Left dirty, to be retried by the next flush */
+			ERROR("Cache flush failed at %lu\n", flush_list[i]->sector);
+			err = sdError_BadResponse;
+			continue;
+		}
+		for (j = 0; j < run; j++) {
+			cache_set_dirty(flush_list[i + j], false);
+		}
+	}
+
+	if (sd_flush() < 0) {
+		err = sdError_BadResponse;
+	}
+	return err;
+}
+
+/*! Drops sectors whose contents on the card are unknown, e.g. after a failed
+ * write. Unwritten changes to them are lost. */
+void cache_discard(uint32_t sector, uint32_t count)
+{
+	cache_entry_t *e;
+
+	if (num_entries == 0) {
+		return;
+	}
+	while (count--) {
+		if ((e = cache_lookup(sector++))) {
+			cache_unhash(e);
+			Remove((struct Node*)&e->node);
+			cache_set_meta(e, false);
+			cache_set_dirty(e, false);
+			AddTail((struct List*)&lru_data, (struct Node*)&e->node);
+		}
+	}
+}
+
+void cache_invalidate(void)
+{
+	uint32_t n;
+
+	for (n = 0; n < num_entries; n++) {
+		if (entries[n].sector != CACHE_NO_SECTOR) {
+			cache_discard(entries[n].sector, 1);
+		}
+	}
+
+	/* Another card may have a different layout, and unwritten changes
+	 * cannot be written to it */
+	num_volumes = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Sector cache for spisd.device
+ *
+ * A fixed pool of 512 byte sectors indexed by a hash table and recycled in
+ * least recently used order. Sectors read from the card and sectors written
+ * to it are stored, so repeated reads of boot, FAT and directory sectors are
+ * served without touching the parallel port. In write-back mode written
+ * sectors are held dirty and written later by cache_flush() in sector order,
+ * each run of consecutive sectors as one multiple-block write.
+ *
+ * The MBR and FAT boot sectors passing through the cache are parsed to find
+ * the boot sector, FATs and FAT12/16 root directory of each volume. Those
+ * sectors are kept on their own LRU list, which file data cannot evict.
+ *
+ * Not thread safe - callers serialise access (see ctx->lock in device.c).
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+/*! Cache size used when neither the mountlist Flags nor ENV:SPISD_CACHE set one */
+#define CACHE_DEFAULT_KB		32
+
+/*! Requests longer than this many sectors update cached sectors but do not
+ * add new ones, so streaming a large file does not flush out the metadata */
+#define CACHE_MAX_RUN			16
+
+/*! Share of the cache that metadata may take from file data */
+#define CACHE_META_PERCENT		75
+
+/*! Share of the cache that may hold written sectors not yet on the card in
+ * write-back mode, cache_write() flushes them all when it would be exceeded */
+#define CACHE_DIRTY_PERCENT		50
+
+int cache_init(uint32_t kbytes);
+void cache_shutdown(void);
+bool cache_read(uint8_t *buf, uint32_t sector, uint32_t count);
+void cache_store(uint8_t *buf, uint32_t sector, uint32_t count);
+bool cache_write(const uint8_t *buf, uint32_t sector, uint32_t count, bool dirty);
+int cache_flush(void);
+void cache_discard(uint32_t sector, uint32_t count);
+void cache_invalidate(void);
+
+#endif /* CACHE_H_ */
@@ -62,7 +62,10 @@ typedef unsigned int bool;
 #include <clib/debug_protos.h>
 #endif
 
-#if DEBUG
+/* SERIAL logs every request. With the binary trace log (TRACE_LOG, see
+ * trace.h) the trace events take its place, so that it does not slow
+ * requests down. */
+#if DEBUG && !TRACE_LOG
 #define SERIAL(a,...)		{ kprintf(__FILE__ "(%d): " a, __LINE__ , ##__VA_ARGS__); }
 #else
 #define SERIAL(...)
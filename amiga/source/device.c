@@ -24,9 +24,12 @@
 #include <exec/interrupts.h>
 #include <exec/errors.h>
 #include <exec/lists.h>
+#include <exec/semaphores.h>
+#include <exec/tasks.h>
 
 #include <dos/dos.h>
 #include <dos/dostags.h>
+#include <dos/dosextens.h>
 
 #include <libraries/expansion.h>
 
@@ -37,6 +40,7 @@
 #include <pragmas/cia_pragmas.h>
 //#include <clib/misc_protos.h>
 
+#include <devices/timer.h>
 #include <devices/trackdisk.h>
 #include <devices/scsidisk.h>
 
@@ -49,9 +53,16 @@
 
 #include <stabs.h>
 
+#include <string.h>
+
 #include "common.h"
 #include "sd.h"
+#include "cache.h"
 #include "spi-par.h"
+#include "timer.h"
+#include "prof.h"
+#include "spisd.h"
+#include "trace.h"
 
 /* These must be globals and the variable names are important */
 
@@ -61,9 +72,31 @@ const char DevIdString[] = "spisd 0.4a (10 Jan 2021)";
 const UWORD DevVersion = 0;
 const UWORD DevRevision = 4;
 
+#define UNIT_TASK_PRI		5
+#define UNIT_TASK_STACK		4096
+
+/*! OpenDevice flags (mountlist Flags) bits giving the sector cache size in KB */
+#define DEVICE_FLAGS_CACHE_KB	0xffff
+/*! OpenDevice flags (mountlist Flags) bit enabling write-back caching */
+#define DEVICE_FLAGS_WRITE_BACK	0x10000
+
+/*! Maximum number of contiguous queued requests done as one transfer */
+#define MERGE_MAX_REQUESTS	16
+
 typedef struct {
 	struct Device		*device;
-	struct Unit			unit;
+	struct Unit			unit;				/* unit_MsgPort queues requests for the unit task */
+	struct Task			*task;				/* unit task doing all card access */
+	struct Task			*parent;			/* task waiting for the unit task to exit */
+	struct timerequest	*wait_tr;			/* UNIT_MICROHZ, sleeps of the unit task */
+	ULONG				wait_sig;			/* signal of wait_tr */
+	struct Task			*open_task;			/* task running the card init in OpenDevice */
+	struct timerequest	*open_tr;			/* UNIT_MICROHZ, sleeps of open_task */
+	struct SignalSemaphore	lock;			/* serialises sd_* and cache_* calls */
+	volatile ULONG		pending;			/* requests queued or being serviced by the unit task */
+	bool				configured;			/* settings read on first open */
+	bool				write_back;			/* CMD_WRITE completes once the data is in the cache */
+	spisd_stats_t		stats;				/* SPISD_CMD_GETSTATS, updated with lock held */
 } device_ctx_t;
 
 /* Global device context allocated on device init */
@@ -78,15 +111,30 @@ struct Library *ciabase;							// Base library for handling Amiga CIA chips.
 struct Interrupt *hw_int;							// Hardware interrupt to detect changes at ACK/FLG line.
 struct Interrupt *sw_int = NULL;						// Software interrupt to be triggered when ACK/FLG hardware interrupt was triggered (Amiga will subsequently ask for TD_CHANGESTATE).
 volatile ULONG disk_state = 0;							// Current disk state {0 = disk present, 1 = disk not present}
+volatile bool disk_changed = false;						// Set on a disk change, the sector cache is invalidated before its next use
+
+/* With the unit task running, FLAG interrupts are counted and passed on to it. Those during
+ * commands that asked for ACK pulses are taken as pulses (spi_get_notify_count()), any
+ * others are card detect changes. */
+struct Task *flag_task = NULL;							// Unit task, signalled on every FLAG interrupt
+ULONG flag_sig;
+volatile ULONG flag_count = 0;							// FLAG interrupts so far
+static ULONG card_events;							// FLAG interrupts handled as card detect changes
 
 static void hw_isr() 
 {
 	SERIAL("Hardware ISR ...\n");
+	if(flag_task) {
+		flag_count++;
+		Signal(flag_task, flag_sig);
+		return;
+	}
 	if(sw_int) {
 		SERIAL("    -> Trigger software interrupt.\n");
 		Cause(sw_int);
 		SERIAL("    -> Change disk state: %ld.\n", disk_state);
 		disk_state = disk_state == 0 ? 1 : 0;
+		disk_changed = true;
 	} else {
 		SERIAL("    -> No software interrupt stored.\n");
 	}
@@ -139,8 +187,547 @@ static uint32_t device_get_geometry(struct IOStdReq *iostd)
 	}
 }
 
+static void device_set_result(struct IOStdReq *iostd, int err)
+{
+	if (err == 0) {
+		if (iostd->io_Command == CMD_READ || iostd->io_Command == CMD_WRITE) {
+			iostd->io_Actual = iostd->io_Length;
+		}
+		iostd->io_Error = 0;
+	} else {
+		iostd->io_Actual = 0;
+		iostd->io_Error = TDERR_NotSpecified;
+		if (err == sdError_Timeout) {
+			ctx->stats.timeouts++;
+		} else if (err == sdError_BadResponse) {
+			ctx->stats.bad_responses++;
+		} else {
+			ctx->stats.errors++;
+		}
+	}
+}
+
+/*! Histogram bucket of a latency, the position of its highest bit */
+static unsigned int device_log2(uint32_t v)
+{
+	unsigned int n = 0;
+
+	while (v >>= 1) {
+		n++;
+	}
+	return n;
+}
+
+/*! Adds a finished queued request or cache hit to the statistics, called with
+ * ctx->lock held. 'start' is the timestamp at which its service began. */
+static void device_count(struct IOStdReq *iostd, uint32_t start)
+{
+	spisd_stats_t *st = &ctx->stats;
+	spisd_type_stats_t *t;
+	uint32_t *hist;
+
+	if (iostd->io_Command == CMD_READ) {
+		t = &st->type[SPISD_TYPE_READ];
+		hist = st->read_hist;
+	} else if (iostd->io_Command == CMD_WRITE) {
+		t = &st->type[SPISD_TYPE_WRITE];
+		hist = st->write_hist;
+	} else {
+		st->type[SPISD_TYPE_SYNC].requests++;
+		return;
+	}
+
+	t->requests++;
+	t->sectors += iostd->io_Length >> SD_SECTOR_SHIFT;
+	t->bytes += iostd->io_Actual;
+	hist[device_log2(timer_get_stamp() - start)]++;
+}
+
+/*! Handles the FLAG interrupts that were not taken for ACK pulses as card
+ * detect changes, called from the unit task. The lock keeps out a command of
+ * another task that has had its pulse but not yet counted it. */
+static void device_card_events(void)
+{
+	ObtainSemaphore(&ctx->lock);
+	while ((LONG)(flag_count - spi_get_notify_count() - card_events) > 0) {
+		card_events++;
+		SERIAL("Card detect change, disk state: %ld.\n", disk_state);
+		if (sw_int) {
+			disk_state = disk_state == 0 ? 1 : 0;
+			disk_changed = true;
+			Cause(sw_int);
+		}
+		TRACE_EVENT(SPISD_EVENT_CARD, 0, 0, 0, disk_state);
+	}
+	ReleaseSemaphore(&ctx->lock);
+}
+
+/*! Waits in the unit task for timeout_ms or until one of 'sigs' arrives */
+static void device_wait(unsigned int timeout_ms, ULONG sigs)
+{
+	struct timerequest *tr = ctx->wait_tr;
+
+	tr->tr_node.io_Command = TR_ADDREQUEST;
+	tr->tr_time.tv_secs = timeout_ms / 1000;
+	tr->tr_time.tv_micro = (timeout_ms % 1000) * 1000;
+	SendIO(&tr->tr_node);
+
+	while (!(Wait(sigs | ctx->wait_sig) & sigs) && !CheckIO(&tr->tr_node)) {
+	}
+
+	if (!CheckIO(&tr->tr_node)) {
+		AbortIO(&tr->tr_node);
+	}
+	WaitIO(&tr->tr_node);
+
+	/* The idle timer of unit_task() shares the signal */
+	SetSignal(ctx->wait_sig, ctx->wait_sig);
+}
+
+/*! Sleeps until the FLAG interrupt signals the unit task or timeout_ms have
+ * passed, called by spi-par.c while the adapter is busy. Other tasks get the
+ * CPU while the card programs a block. Returns at once in other tasks. */
+static void device_sleep(unsigned int timeout_ms)
+{
+	if (ctx->wait_tr && FindTask(NULL) == ctx->task) {
+		device_wait(timeout_ms, flag_sig);
+	}
+}
+
+/*! Sleeps for about 'ms' in the long waits of sd.c and spi-par.c, see
+ * timer_wait_poll(). The unit task uses its wait_tr, the task opening the
+ * device the open_tr that __UserDevOpen() sets up for the card init. */
+static bool device_delay(unsigned int ms)
+{
+	struct Task *task = FindTask(NULL);
+	struct timerequest *tr;
+
+	if (task == ctx->task && ctx->wait_tr) {
+		device_wait(ms, 0);
+		return true;
+	}
+	if (task == ctx->open_task && (tr = ctx->open_tr)) {
+		tr->tr_node.io_Command = TR_ADDREQUEST;
+		tr->tr_time.tv_secs = ms / 1000;
+		tr->tr_time.tv_micro = (ms % 1000) * 1000;
+		DoIO(&tr->tr_node);
+		return true;
+	}
+	return false;
+}
+
+/*! Opens a UNIT_MICROHZ timer request replying to a new port of the calling
+ * task, NULL if that fails */
+static struct timerequest *device_open_timer(void)
+{
+	struct MsgPort *port = CreatePort(NULL, 0);
+	struct timerequest *tr = NULL;
+
+	if (port) {
+		tr = (struct timerequest*)CreateExtIO(port, sizeof(struct timerequest));
+		if (tr && OpenDevice((STRPTR)TIMERNAME, UNIT_MICROHZ, &tr->tr_node, 0) != 0) {
+			DeleteExtIO(&tr->tr_node);
+			tr = NULL;
+		}
+		if (tr == NULL) {
+			DeletePort(port);
+		}
+	}
+	return tr;
+}
+
+static void device_close_timer(struct timerequest *tr)
+{
+	struct MsgPort *port;
+
+	if (tr) {
+		port = tr->tr_node.io_Message.mn_ReplyPort;
+		CloseDevice(&tr->tr_node);
+		DeleteExtIO(&tr->tr_node);
+		DeletePort(port);
+	}
+}
+
+/*! Writes out sectors held by a write-back cache and closes a multiple-block
+ * transfer left open by CMD_READ/CMD_WRITE, called with ctx->lock held */
+static int device_sync(void)
+{
+	int err, flush_err;
+
+	err = cache_flush();
+	flush_err = sd_flush();
+
+	return err ? err : flush_err;
+}
+
+/*! Drops the cache contents after a disk change, called with ctx->lock held */
+static void device_check_change(void)
+{
+	if (disk_changed) {
+		disk_changed = false;
+		cache_invalidate();
+	}
+}
+
+/*! SPISD_CMD_GETPROFILE, called with ctx->lock held */
+static void device_get_profile(struct IOStdReq *iostd)
+{
+	if (iostd->io_Data == NULL || iostd->io_Length < sizeof(spisd_profile_t)) {
+		iostd->io_Actual = 0;
+		iostd->io_Error = IOERR_BADLENGTH;
+		return;
+	}
+
+	prof_get((spisd_profile_t*)iostd->io_Data);
+	if (iostd->io_Offset == 1) {
+		prof_clear();
+	}
+	iostd->io_Actual = sizeof(spisd_profile_t);
+	iostd->io_Error = 0;
+}
+
+/*! SPISD_CMD_GETSTATS, called with ctx->lock held. The OTHER count is
+ * updated by __BeginIO() under Forbid() only, which may run in any task, so
+ * the copy and the reset are done under Forbid() as well. */
+static void device_get_stats(struct IOStdReq *iostd)
+{
+	if (iostd->io_Data == NULL || iostd->io_Length < sizeof(spisd_stats_t)) {
+		iostd->io_Actual = 0;
+		iostd->io_Error = IOERR_BADLENGTH;
+		return;
+	}
+
+	Forbid();
+	ctx->stats.freq = timer_get_stamp_freq();
+	CopyMem(&ctx->stats, iostd->io_Data, sizeof(spisd_stats_t));
+	if (iostd->io_Offset == 1) {
+		memset(&ctx->stats, 0, sizeof(spisd_stats_t));
+	}
+	Permit();
+	iostd->io_Actual = sizeof(spisd_stats_t);
+	iostd->io_Error = 0;
+}
+
+#if TRACE_LOG
+/*! SPISD_CMD_GETTRACE, called with ctx->lock held */
+static void device_get_trace(struct IOStdReq *iostd)
+{
+	spisd_trace_head_t *head = (spisd_trace_head_t*)iostd->io_Data;
+	unsigned int n;
+
+	if (head == NULL || iostd->io_Length < sizeof(spisd_trace_head_t)) {
+		iostd->io_Actual = 0;
+		iostd->io_Error = IOERR_BADLENGTH;
+		return;
+	}
+
+	n = trace_get(head, (spisd_trace_t*)(head + 1),
+			(iostd->io_Length - sizeof(spisd_trace_head_t)) / sizeof(spisd_trace_t));
+	if (iostd->io_Offset == 1) {
+		trace_clear();
+	}
+	iostd->io_Actual = sizeof(spisd_trace_head_t) + n * sizeof(spisd_trace_t);
+	iostd->io_Error = 0;
+}
+#endif
+
+/*! Performs a queued request other than CMD_READ/CMD_WRITE, called from the unit task */
+static void device_do_io(struct IOStdReq *iostd)
+{
+	ObtainSemaphore(&ctx->lock);
+	if (iostd->io_Command == SPISD_CMD_GETPROFILE) {
+		device_get_profile(iostd);
+	} else if (iostd->io_Command == SPISD_CMD_GETSTATS) {
+		device_get_stats(iostd);
+#if TRACE_LOG
+	} else if (iostd->io_Command == SPISD_CMD_GETTRACE) {
+		device_get_trace(iostd);
+#endif
+	} else {
+		device_check_change();
+		device_set_result(iostd, device_sync());
+		device_count(iostd, 0);
+	}
+	ReleaseSemaphore(&ctx->lock);
+}
+
+/*! Moves the requests queued directly behind batch[0] that continue its
+ * CMD_READ/CMD_WRITE at the following sector into the batch */
+static unsigned int device_merge(struct IOStdReq **batch)
+{
+	struct MsgPort *port = &ctx->unit.unit_MsgPort;
+	struct IOStdReq *next;
+	ULONG end = batch[0]->io_Offset + batch[0]->io_Length;
+	unsigned int n = 1;
+
+	if (batch[0]->io_Length & (SD_SECTOR_SIZE - 1)) {
+		return n;
+	}
+
+	Forbid();
+	while (n < MERGE_MAX_REQUESTS) {
+		next = (struct IOStdReq*)port->mp_MsgList.lh_Head;
+		if (next->io_Message.mn_Node.ln_Succ == NULL ||
+				next->io_Command != batch[0]->io_Command ||
+				next->io_Offset != end ||
+				(next->io_Length & (SD_SECTOR_SIZE - 1))) {
+			break;
+		}
+		Remove(&next->io_Message.mn_Node);
+		end += next->io_Length;
+		batch[n++] = next;
+	}
+	Permit();
+
+	return n;
+}
+
+/*! Serves a CMD_READ from the sector cache, called with ctx->lock held */
+static bool device_cache_read(struct IOStdReq *iostd)
+{
+	device_check_change();
+	if (iostd->io_Length & (SD_SECTOR_SIZE - 1)) {
+		return false;
+	}
+	if (cache_read(iostd->io_Data, iostd->io_Offset >> SD_SECTOR_SHIFT, iostd->io_Length >> SD_SECTOR_SHIFT)) {
+		iostd->io_Actual = iostd->io_Length;
+		iostd->io_Error = 0;
+		ctx->stats.cache_hits++;
+		return true;
+	}
+	return false;
+}
+
+/*! Holds a CMD_WRITE in the write-back cache, called with ctx->lock held */
+static bool device_cache_write(struct IOStdReq *iostd)
+{
+	if (!ctx->write_back || (iostd->io_Length & (SD_SECTOR_SIZE - 1))) {
+		return false;
+	}
+	if (cache_write(iostd->io_Data, iostd->io_Offset >> SD_SECTOR_SHIFT, iostd->io_Length >> SD_SECTOR_SHIFT, true)) {
+		iostd->io_Actual = iostd->io_Length;
+		iostd->io_Error = 0;
+		return true;
+	}
+	return false;
+}
+
+/*! Performs a batch of contiguous CMD_READ or CMD_WRITE requests as one transfer, called from the unit task */
+static void device_do_rw(struct IOStdReq **batch, unsigned int n)
+{
+	int (*xfer)(uint32_t, const sd_segment_t*, unsigned int);
+	sd_segment_t seg[MERGE_MAX_REQUESTS];
+	unsigned int i, first;
+	uint32_t start = timer_get_stamp();
+	int err;
+
+	xfer = (batch[0]->io_Command == CMD_WRITE) ? sd_write_segments : sd_read_segments;
+	for (i = 0; i < n; i++) {
+		seg[i].buf = batch[i]->io_Data;
+		seg[i].count = batch[i]->io_Length >> SD_SECTOR_SHIFT;
+	}
+
+	ObtainSemaphore(&ctx->lock);
+	device_check_change();
+
+	/* Leading requests the cache completes: read hits, and writes in write-back mode */
+	for (first = 0; first < n; first++) {
+		if (batch[first]->io_Command == CMD_READ ? !device_cache_read(batch[first]) : !device_cache_write(batch[first])) {
+			break;
+		}
+	}
+	if (first == n) {
+		for (i = 0; i < n; i++) {
+			device_count(batch[i], start);
+		}
+		ReleaseSemaphore(&ctx->lock);
+		return;
+	}
+
+	err = xfer(batch[first]->io_Offset >> SD_SECTOR_SHIFT, &seg[first], n - first);
+	if (err != 0 && n - first > 1) {
+		/* Retry one at a time so that only the failing requests report an error */
+		for (i = first; i < n; i++) {
+			device_set_result(batch[i], xfer(batch[i]->io_Offset >> SD_SECTOR_SHIFT, &seg[i], 1));
+		}
+	} else {
+		for (i = first; i < n; i++) {
+			device_set_result(batch[i], err);
+		}
+	}
+
+	/* Keep the cache in step with the card */
+	for (i = first; i < n; i++) {
+		if (batch[i]->io_Command == CMD_READ) {
+			if (batch[i]->io_Error == 0) {
+				cache_store(seg[i].buf, batch[i]->io_Offset >> SD_SECTOR_SHIFT, seg[i].count);
+			}
+		} else if (batch[i]->io_Error == 0) {
+			cache_write(seg[i].buf, batch[i]->io_Offset >> SD_SECTOR_SHIFT, seg[i].count, false);
+		} else {
+			cache_discard(batch[i]->io_Offset >> SD_SECTOR_SHIFT, seg[i].count);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i >= first && batch[i]->io_Command == CMD_READ) {
+			ctx->stats.cache_misses++;
+		}
+		device_count(batch[i], start);
+	}
+	ReleaseSemaphore(&ctx->lock);
+}
+
+/*! Unit task, services the requests queued by __BeginIO until signalled to exit.
+ * Once no request has arrived for SD_STREAM_IDLE_MS, sectors held by a write-back
+ * cache are written out and an open multiple-block transfer is closed, so the
+ * card does not stay selected while the system is idle. */
+static void __saveds unit_task(void)
+{
+	struct MsgPort *port = &ctx->unit.unit_MsgPort;
+	struct MsgPort *timer_port;
+	struct timerequest *tr = NULL;
+	struct IOStdReq *batch[MERGE_MAX_REQUESTS];
+	struct Message *msg;
+	unsigned int i, n;
+	ULONG port_sig, timer_sig = 0, sigs;
+	BYTE sigbit, flag_sigbit;
+	bool active = false, timer_pending = false;
+
+	/* Start signalling for requests queued since the port was set up in __UserDevInit */
+	sigbit = AllocSignal(-1);
+	Forbid();
+	port->mp_SigBit = sigbit;
+	port->mp_SigTask = FindTask(NULL);
+	port->mp_Flags = PA_SIGNAL;
+	Permit();
+	port_sig = 1ul << sigbit;
+
+	/* Idle timer, without it streams are only closed by sd.c when the next request arrives */
+	if ((timer_port = CreatePort(NULL, 0))) {
+		tr = (struct timerequest*)CreateExtIO(timer_port, sizeof(struct timerequest));
+		if (tr && OpenDevice((STRPTR)TIMERNAME, UNIT_VBLANK, &tr->tr_node, 0) != 0) {
+			DeleteExtIO(&tr->tr_node);
+			tr = NULL;
+		}
+		if (tr) {
+			timer_sig = 1ul << timer_port->mp_SigBit;
+		}
+
+		/* Sleeps while the card is busy, on the same port */
+		ctx->wait_tr = (struct timerequest*)CreateExtIO(timer_port, sizeof(struct timerequest));
+		if (ctx->wait_tr && OpenDevice((STRPTR)TIMERNAME, UNIT_MICROHZ, &ctx->wait_tr->tr_node, 0) != 0) {
+			DeleteExtIO(&ctx->wait_tr->tr_node);
+			ctx->wait_tr = NULL;
+		}
+		if (ctx->wait_tr) {
+			ctx->wait_sig = 1ul << timer_port->mp_SigBit;
+			timer_set_device(ctx->wait_tr->tr_node.io_Device);
+		}
+	}
+	timer_set_sleep(device_delay);
+	prof_start();
+
+	/* Take over the FLAG interrupt, and sleep on it while the adapter is busy */
+	flag_sigbit = AllocSignal(-1);
+	if (flag_sigbit >= 0) {
+		Forbid();
+		flag_sig = 1ul << flag_sigbit;
+		flag_task = FindTask(NULL);
+		Permit();
+		spi_set_flag_count((volatile uint32_t*)&flag_count);
+		spi_set_sleep(device_sleep);
+	}
+
+	for (;;) {
+		while ((msg = GetMsg(port))) {
+			batch[0] = (struct IOStdReq*)msg;
+			if (batch[0]->io_Command == CMD_READ || batch[0]->io_Command == CMD_WRITE) {
+				n = device_merge(batch);
+				device_do_rw(batch, n);
+			} else {
+				n = 1;
+				device_do_io(batch[0]);
+			}
+			Forbid();
+			ctx->pending -= n;
+			Permit();
+			for (i = 0; i < n; i++) {
+				TRACE_EVENT(SPISD_EVENT_REPLY, batch[i]->io_Command, batch[i]->io_Offset >> SD_SECTOR_SHIFT,
+						batch[i]->io_Length >> SD_SECTOR_SHIFT, batch[i]->io_Error);
+				ReplyMsg(&batch[i]->io_Message);
+			}
+			active = true;
+			device_card_events();
+		}
+
+		if (active && tr && !timer_pending) {
+			tr->tr_node.io_Command = TR_ADDREQUEST;
+			tr->tr_time.tv_secs = SD_STREAM_IDLE_MS / 1000;
+			tr->tr_time.tv_micro = (SD_STREAM_IDLE_MS % 1000) * 1000;
+			SendIO(&tr->tr_node);
+			timer_pending = true;
+			active = false;
+		}
+
+		sigs = Wait(port_sig | timer_sig | flag_sig | SIGBREAKF_CTRL_C);
+		if (sigs & SIGBREAKF_CTRL_C) {
+			break;
+		}
+		device_card_events();
+		if (timer_pending && CheckIO(&tr->tr_node)) {
+			WaitIO(&tr->tr_node);
+			timer_pending = false;
+			if (!active) {
+				ObtainSemaphore(&ctx->lock);
+				device_sync();
+				ReleaseSemaphore(&ctx->lock);
+			}
+		}
+	}
+
+	ObtainSemaphore(&ctx->lock);
+	device_sync();
+	ReleaseSemaphore(&ctx->lock);
+
+	if (flag_sigbit >= 0) {
+		spi_set_sleep(NULL);
+		spi_set_flag_count(NULL);
+		Forbid();
+		flag_task = NULL;
+		Permit();
+		FreeSignal(flag_sigbit);
+	}
+	prof_stop();
+	timer_set_sleep(NULL);
+	if (ctx->wait_tr) {
+		timer_set_device(NULL);
+		CloseDevice(&ctx->wait_tr->tr_node);
+		DeleteExtIO(&ctx->wait_tr->tr_node);
+		ctx->wait_tr = NULL;
+	}
+	if (tr) {
+		if (timer_pending) {
+			AbortIO(&tr->tr_node);
+			WaitIO(&tr->tr_node);
+		}
+		CloseDevice(&tr->tr_node);
+		DeleteExtIO(&tr->tr_node);
+	}
+	if (timer_port) {
+		DeletePort(timer_port);
+	}
+
+	/* Exit with Forbid() held so the parent cannot unload us before RemTask() */
+	Forbid();
+	port->mp_Flags = PA_IGNORE;
+	FreeSignal(sigbit);
+	Signal(ctx->parent, SIGF_SINGLE);
+}
+
 int __UserDevInit(struct Device *device)
 {
+	struct MsgPort *port;
 
 	//SERIAL("Device init: spisd.device rev 0.4b (2020)\n");
 
@@ -154,6 +741,19 @@ int __UserDevInit(struct Device *device)
 		goto error;
 	}
 	ctx->device = device;
+	InitSemaphore(&ctx->lock);
+
+	/* Requests are queued until the unit task has allocated its signal */
+	port = &ctx->unit.unit_MsgPort;
+	port->mp_Node.ln_Type = NT_MSGPORT;
+	port->mp_Flags = PA_IGNORE;
+	NewList(&port->mp_MsgList);
+
+	ctx->task = CreateTask((STRPTR)DevName, UNIT_TASK_PRI, (APTR)unit_task, UNIT_TASK_STACK);
+	if (ctx->task == NULL) {
+		ERROR("Unit task creation failed\n");
+		goto error;
+	}
 
 	/* Initialise hardware */
 	spi_init();
@@ -166,6 +766,10 @@ int __UserDevInit(struct Device *device)
 
 error:
 	/* Clean up after failed open */
+	if (ctx) {
+		FreeMem(ctx, sizeof(device_ctx_t));
+		ctx = NULL;
+	}
 	return 0;
 
 }
@@ -176,7 +780,14 @@ void __UserDevCleanup(void)
 	SERIAL("Device cleanup ...\n");
 
 	if (ctx) {
+		/* Stop the unit task, it writes out held sectors and closes any open transfer on the way out */
+		ctx->parent = FindTask(NULL);
+		SetSignal(0, SIGF_SINGLE);
+		Signal(ctx->task, SIGBREAKF_CTRL_C);
+		Wait(SIGF_SINGLE);
+
 		spi_shutdown();
+		cache_shutdown();
 
 		/* Free context memory */
 		FreeMem(ctx, sizeof(device_ctx_t));
@@ -186,6 +797,81 @@ void __UserDevCleanup(void)
 	/* Clean up libs */
 }
 
+/*! Reads a decimal number from an ENV: variable, ENV: files work on KS1.3
+ * as well. DOSBase is NULL unless the device is opened by a process. System
+ * requesters are off meanwhile, so that a missing ENV: assign fails instead
+ * of asking for a volume while the device is being opened. */
+static bool device_get_env(struct DosLibrary *DOSBase, const char *path, uint32_t *value)
+{
+	struct Process *proc;
+	APTR window;
+	char buf[12];
+	BPTR fh;
+	LONG len, n;
+	bool found = false;
+
+	if (DOSBase == NULL) {
+		return false;
+	}
+	proc = (struct Process*)FindTask(NULL);
+	window = proc->pr_WindowPtr;
+	proc->pr_WindowPtr = (APTR)-1;
+	if ((fh = Open((STRPTR)path, MODE_OLDFILE))) {
+		len = Read(fh, buf, sizeof(buf));
+		Close(fh);
+		*value = 0;
+		for (n = 0; n < len && buf[n] >= '0' && buf[n] <= '9'; n++) {
+			*value = *value * 10 + (buf[n] - '0');
+			found = true;
+		}
+	}
+	proc->pr_WindowPtr = window;
+
+	return found;
+}
+
+/*! Sizes the sector cache from the mountlist Flags, ENV:SPISD_CACHE or
+ * CACHE_DEFAULT_KB, in that order. SPISD_CACHE=0 disables the cache.
+ * Write-back is enabled by DEVICE_FLAGS_WRITE_BACK or ENV:SPISD_WRITEBACK=1.
+ * ENV:SPISD_IRQCHUNK limits the bytes transferred with interrupts disabled.
+ * ENV:SPISD_PREFETCH=0 turns off the read ahead on the adapter.
+ * ENV:SPISD_STROBE=1 allows strobe mode on adapters that have it. */
+static void device_configure(uint32_t flags)
+{
+	uint32_t kbytes = flags & DEVICE_FLAGS_CACHE_KB;
+	uint32_t write_back = 0;
+	uint32_t irq_chunk;
+	uint32_t prefetch;
+	uint32_t strobe = 0;
+	struct DosLibrary *DOSBase = NULL;
+
+	if (FindTask(NULL)->tc_Node.ln_Type == NT_PROCESS) {
+		DOSBase = (struct DosLibrary*)OpenLibrary((STRPTR)"dos.library", 0);
+	}
+	if (kbytes == 0 && !device_get_env(DOSBase, "ENV:SPISD_CACHE", &kbytes)) {
+		kbytes = CACHE_DEFAULT_KB;
+	}
+	if (!(flags & DEVICE_FLAGS_WRITE_BACK)) {
+		device_get_env(DOSBase, "ENV:SPISD_WRITEBACK", &write_back);
+	}
+	ctx->write_back = (flags & DEVICE_FLAGS_WRITE_BACK) || write_back != 0;
+	if (cache_init(kbytes) < 0) {
+		ERROR("No sector cache\n");
+	}
+	if (device_get_env(DOSBase, "ENV:SPISD_IRQCHUNK", &irq_chunk)) {
+		spi_set_max_transfer(irq_chunk);
+	}
+	if (device_get_env(DOSBase, "ENV:SPISD_PREFETCH", &prefetch)) {
+		sd_set_prefetch(prefetch != 0);
+	}
+	device_get_env(DOSBase, "ENV:SPISD_STROBE", &strobe);
+	spi_set_strobe(strobe != 0);
+	if (DOSBase) {
+		CloseLibrary((struct Library*)DOSBase);
+	}
+	ctx->configured = true;
+}
+
 int __UserDevOpen(struct IORequest *ioreq, uint32_t unit, uint32_t flags)
 {
 
@@ -195,12 +881,38 @@ int __UserDevOpen(struct IORequest *ioreq, uint32_t unit, uint32_t flags)
 	SERIAL("Device open ...\n");
 
 	if (iostd && unit == 0) {
-		if (sd_open() == 0) {
+		ObtainSemaphore(&ctx->lock);
+		if (!ctx->configured) {
+			device_configure(flags);
+		}
+		if (ctx->unit.unit_OpenCnt == 0 || disk_changed || sd_get_card_info()->type == sdCardType_None) {
+			/* The card may have been swapped while the device was closed. Further
+			 * opens, such as spisdstat next to a mounted filesystem, leave it alone. */
+			ctx->open_task = FindTask(NULL);
+			ctx->open_tr = device_open_timer();
+			if (disk_changed) {
+				sd_flush();
+			} else {
+				device_sync();
+			}
+			err = sd_open();
+			cache_invalidate();
+			disk_changed = false;
+			device_close_timer(ctx->open_tr);
+			ctx->open_tr = NULL;
+			ctx->open_task = NULL;
+		} else {
+			err = 0;
+		}
+		if (err == 0) {
 			/* Device is open */
 			iostd->io_Unit = &ctx->unit;
 			ctx->unit.unit_flags = UNITF_ACTIVE;
-			ctx->unit.unit_OpenCnt = 1;
-			err = 0;
+			ctx->unit.unit_OpenCnt++;
+		}
+		ReleaseSemaphore(&ctx->lock);
+		if (err != 0) {
+			err = IOERR_OPENFAIL;
 		}
 	}
 
@@ -210,12 +922,51 @@ int __UserDevOpen(struct IORequest *ioreq, uint32_t unit, uint32_t flags)
 
 int __UserDevClose(struct IORequest *ioreq)
 {
+	uint32_t hits, misses;
 
 	SERIAL("Device close ...\n");
+	INFO("Interrupts disabled for up to %lu us per transfer\n", spi_get_max_disabled_us());
+
+	ObtainSemaphore(&ctx->lock);
+	device_sync();
+	sd_get_prefetch_stats(&hits, &misses);
+	if (ioreq && ioreq->io_Unit == &ctx->unit && ctx->unit.unit_OpenCnt > 0) {
+		ctx->unit.unit_OpenCnt--;
+	}
+	ReleaseSemaphore(&ctx->lock);
+	INFO("Sectors read ahead by the adapter: %lu used, %lu dropped\n", hits, misses);
 
 	return 0;
 }
 
+/*! Passes a request that accesses the card to the unit task, which replies to it */
+static void device_queue(struct IOStdReq *iostd)
+{
+	iostd->io_Flags &= ~IOF_QUICK;
+	Forbid();
+	ctx->pending++;
+	PutMsg(&ctx->unit.unit_MsgPort, &iostd->io_Message);
+	Permit();
+}
+
+/*! Serves a CMD_READ from the sector cache in the caller's context. Only done
+ * when the unit task has nothing in hand, so it cannot overtake a queued write. */
+static bool device_read_quick(struct IOStdReq *iostd)
+{
+	bool hit = false;
+	uint32_t start;
+
+	if (ctx->pending == 0 && AttemptSemaphore(&ctx->lock)) {
+		start = timer_get_stamp();
+		hit = device_cache_read(iostd);
+		if (hit) {
+			device_count(iostd, start);
+		}
+		ReleaseSemaphore(&ctx->lock);
+	}
+	return hit;
+}
+
 ADDTABL_1(__BeginIO,a1);
 
 void __BeginIO(struct IORequest *ioreq)
@@ -231,20 +982,26 @@ void __BeginIO(struct IORequest *ioreq)
 	iostd->io_Error = 0;
 
 	SERIAL("Device begin IO ...\n");
+	TRACE_EVENT(SPISD_EVENT_BEGIN, iostd->io_Command, iostd->io_Offset >> SD_SECTOR_SHIFT,
+			iostd->io_Length >> SD_SECTOR_SHIFT, 0);
 
 	switch (iostd->io_Command) {
 		case CMD_RESET:
 			SERIAL("  CMD_RESET: CMD=%ld\n", iostd->io_Command);
-			break;
+			device_queue(iostd);
+			return;
 		case CMD_CLEAR:
 			SERIAL("  CMD_CLEAR: CMD=%ld\n", iostd->io_Command);
-			break;
+			device_queue(iostd);
+			return;
 		case CMD_UPDATE:
 			SERIAL("  CMD_UPDATE: CMD=%ld\n", iostd->io_Command);
-			break;
+			device_queue(iostd);
+			return;
 		case TD_MOTOR:
 			SERIAL("  TD_MOTOR: CMD=%ld\n", iostd->io_Command);
-			break;
+			device_queue(iostd);
+			return;
 		case TD_PROTSTATUS:
 			SERIAL("  TD_PROTSTATUS: CMD=%ld\n", iostd->io_Command);
 			/* Should return a non-zero value if the card is write protected */
@@ -293,33 +1050,46 @@ void __BeginIO(struct IORequest *ioreq)
 			SERIAL("  TD_FORMAT: CMD=%ld\n", iostd->io_Command);
 			break;
 		case CMD_WRITE:
-			/* FIXME: Should be deferred to task but this did not work reliably - investigate */
-			if (sd_write(iostd->io_Data, iostd->io_Offset >> SD_SECTOR_SHIFT, iostd->io_Length >> SD_SECTOR_SHIFT) == 0) {
-				iostd->io_Actual = iostd->io_Length;
-				iostd->io_Error = 0;
-			} else {
-				iostd->io_Actual = 0;
-				iostd->io_Error = TDERR_NotSpecified;
-			}
 			SERIAL("  CMD_WRITE: CMD=%ld\n", iostd->io_Command);
-			break;
+			device_queue(iostd);
+			return;
 		case CMD_READ:
-			if (sd_read(iostd->io_Data, iostd->io_Offset >> SD_SECTOR_SHIFT, iostd->io_Length >> SD_SECTOR_SHIFT) == 0) {
-				iostd->io_Actual = iostd->io_Length;
-				iostd->io_Error = 0;
-			} else {
-				iostd->io_Actual = 0;
-				iostd->io_Error = TDERR_NotSpecified;
-			}
 			SERIAL("  CMD_READ: CMD=%ld\n", iostd->io_Command);
-			break;
+			if (device_read_quick(iostd)) {
+				break;
+			}
+			device_queue(iostd);
+			return;
+		case SPISD_CMD_GETPROFILE:
+			SERIAL("  SPISD_CMD_GETPROFILE: CMD=%ld\n", iostd->io_Command);
+			device_queue(iostd);
+			return;
+		case SPISD_CMD_GETSTATS:
+			SERIAL("  SPISD_CMD_GETSTATS: CMD=%ld\n", iostd->io_Command);
+			device_queue(iostd);
+			return;
+#if TRACE_LOG
+		case SPISD_CMD_GETTRACE:
+			SERIAL("  SPISD_CMD_GETTRACE: CMD=%ld\n", iostd->io_Command);
+			device_queue(iostd);
+			return;
+#endif
 		default:
 			SERIAL("  CMD_???: CMD=%ld\n", iostd->io_Command);
 			iostd->io_Error = IOERR_NOCMD;
 	}
 
+	if (iostd->io_Command != CMD_READ) {
+		/* Answered at once, cache hits of CMD_READ are counted with the reads */
+		Forbid();
+		ctx->stats.type[SPISD_TYPE_OTHER].requests++;
+		Permit();
+	}
+	TRACE_EVENT(SPISD_EVENT_REPLY, iostd->io_Command, iostd->io_Offset >> SD_SECTOR_SHIFT,
+			iostd->io_Length >> SD_SECTOR_SHIFT, iostd->io_Error);
+
 	if (iostd && !(iostd->io_Flags & IOF_QUICK)) {
-		/* Reply to message now unless it was deferred to the task or is IOF_QUICK */
+		/* Reply to message now unless it is IOF_QUICK, queued requests are replied to by the unit task */
 		ReplyMsg(&iostd->io_Message);
 	}
 	
@@ -329,15 +1099,27 @@ ADDTABL_1(__AbortIO,a1);
 
 void __AbortIO(struct IORequest *ioreq)
 {
+	struct Node *node;
 
 	SERIAL("Device abort io ...\n");
 
-	if (ioreq == NULL) {
+	if (ctx == NULL || ioreq == NULL) {
 		return;
 	}
 
-	ioreq->io_Error = IOERR_ABORTED;
-	return;
+	/* Only a request still waiting in the queue can be aborted, one being
+	 * serviced by the unit task completes normally */
+	Forbid();
+	for (node = ctx->unit.unit_MsgPort.mp_MsgList.lh_Head; node->ln_Succ; node = node->ln_Succ) {
+		if (node == &ioreq->io_Message.mn_Node) {
+			Remove(node);
+			ctx->pending--;
+			ioreq->io_Error = IOERR_ABORTED;
+			ReplyMsg(&ioreq->io_Message);
+			break;
+		}
+	}
+	Permit();
 }
 
 ADDTABL_END();
@@ -0,0 +1,427 @@
+/*
+ * sdbench - host benchmark for sd.c against a simulated SD card
+ *
+ * Runs card init followed by sequential and random read/write workloads
+ * through sd_read()/sd_write(), plus runs of single sector reads merged
+ * through sd_read_segments(), and sequential reads with a stray POUT toggle
+ * of the idle wait after each request, and reports, per workload, the SD commands
+ * issued, the parallel port transactions and bytes, and the modelled time
+ * and throughput. All data read is verified against the image file.
+ *
+ * Usage: sdbench [options] image
+ * The image is created (zero filled) if it does not exist.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "sd.h"
+#include "spi-par.h"
+#include "prof.h"
+#include "sim.h"
+
+#define MAX_CHUNK			256
+
+typedef struct {
+	sdcard_stats_t		card;
+	sim_port_stats_t	port;
+	uint64_t			time_ns;
+} snapshot_t;
+
+static sdcard_t *card;
+static FILE *image;
+static uint32_t image_sectors;
+static int failures;
+static uint64_t host_ns;			/* host time between sequential read requests */
+
+static uint8_t buf[MAX_CHUNK * SD_SECTOR_SIZE];
+static uint8_t ref[MAX_CHUNK * SD_SECTOR_SIZE];
+
+static uint32_t rng_state = 12345;
+static uint32_t sleeps;
+static uint32_t delays;
+static uint64_t delay_ns;
+
+/* Stands for the unit task sleeping on the FLAG interrupt, the simulation keeps the time */
+static void bench_sleep(unsigned int timeout_ms)
+{
+	(void)timeout_ms;
+	sleeps++;
+}
+
+/* Stands for the unit task sleeping on timer.device in a long wait */
+static bool bench_delay(unsigned int ms)
+{
+	delays++;
+	delay_ns += (uint64_t)ms * 1000000;
+	sim_advance_ns((uint64_t)ms * 1000000);
+	return true;
+}
+
+static uint32_t rng(void)
+{
+	rng_state = rng_state * 1103515245u + 12345u;
+	return rng_state >> 8;
+}
+
+static void take_snapshot(snapshot_t *s)
+{
+	s->card = *sdcard_get_stats(card);
+	s->port = *sim_get_port_stats();
+	s->time_ns = sim_get_time_ns();
+}
+
+static void print_header(void)
+{
+	printf("%-11s %6s %7s %7s %9s %6s %6s %6s %6s %6s %6s %6s %9s %8s %8s\n",
+			"workload", "ops", "sectors", "xfers", "bytes",
+			"CMD17", "CMD18", "CMD12", "CMD24", "CMD25", "ACMD23", "CMD55",
+			"time_ms", "KB/s", "IOPS");
+}
+
+static void report(const char *name, const snapshot_t *before, uint32_t ops, uint32_t sectors)
+{
+	snapshot_t after;
+	double ms, kbs, iops;
+
+	take_snapshot(&after);
+	ms = (double)(after.time_ns - before->time_ns) / 1e6;
+	kbs = ms > 0 ? (sectors * (double)SD_SECTOR_SIZE / 1024.0) / (ms / 1000.0) : 0;
+	iops = ms > 0 ? ops / (ms / 1000.0) : 0;
+
+#define DELTA(f)	(unsigned int)(after.f - before->f)
+	printf("%-11s %6u %7u %7u %9u %6u %6u %6u %6u %6u %6u %6u %9.2f %8.1f %8.1f\n",
+			name, ops, sectors,
+			DELTA(port.transactions), DELTA(port.bytes),
+			DELTA(card.cmd[17]), DELTA(card.cmd[18]), DELTA(card.cmd[12]),
+			DELTA(card.cmd[24]), DELTA(card.cmd[25]), DELTA(card.acmd[23]),
+			DELTA(card.cmd[55]),
+			ms, kbs, iops);
+#undef DELTA
+}
+
+/* Time per phase, as SPISD_CMD_GETPROFILE returns it */
+static void print_profile(void)
+{
+	static const char * const names[SPISD_PHASES] = {
+		"idle", "command", "token", "busy", "data", "stop"
+	};
+	spisd_profile_t p;
+	unsigned int i;
+
+	prof_get(&p);
+	printf("time per phase:");
+	for (i = 0; i < SPISD_PHASES; i++) {
+		printf(" %s %.1f ms (%u)", names[i], (double)p.time[i] * 1000 / p.freq, (unsigned int)p.count[i]);
+	}
+	printf("\n");
+}
+
+static void read_image(uint8_t *dst, uint32_t sector, uint32_t count)
+{
+	fflush(image);
+	fseeko(image, (off_t)sector * SD_SECTOR_SIZE, SEEK_SET);
+	if (fread(dst, SD_SECTOR_SIZE, count, image) != count) {
+		fprintf(stderr, "short image read at sector %u\n", (unsigned int)sector);
+		exit(1);
+	}
+}
+
+static void fill_pattern(uint8_t *dst, uint32_t sector, uint32_t count, uint32_t seed)
+{
+	uint32_t n;
+
+	for (n = 0; n < count * SD_SECTOR_SIZE; n++) {
+		dst[n] = (uint8_t)((sector + n / SD_SECTOR_SIZE) * 31 + n + seed);
+	}
+}
+
+static void check_read(uint32_t sector, uint32_t count, int err)
+{
+	if (err != 0) {
+		fprintf(stderr, "sd_read(%u, %u) failed: %d\n", (unsigned int)sector, (unsigned int)count, err);
+		failures++;
+		return;
+	}
+	read_image(ref, sector, count);
+	if (memcmp(buf, ref, count * SD_SECTOR_SIZE) != 0) {
+		fprintf(stderr, "sd_read(%u, %u) returned wrong data\n", (unsigned int)sector, (unsigned int)count);
+		failures++;
+	}
+}
+
+static void check_write(uint32_t sector, uint32_t count, int err)
+{
+	if (err != 0) {
+		fprintf(stderr, "sd_write(%u, %u) failed: %d\n", (unsigned int)sector, (unsigned int)count, err);
+		failures++;
+	}
+}
+
+static void run_seq_read(uint32_t base, uint32_t total, uint32_t chunk)
+{
+	snapshot_t s;
+	uint32_t sector, ops = 0;
+
+	take_snapshot(&s);
+	for (sector = base; sector < base + total; sector += chunk) {
+		check_read(sector, chunk, sd_read(buf, sector, chunk));
+		sim_advance_ns(host_ns);
+		ops++;
+	}
+	sd_flush();
+	report("seq-read", &s, ops, total);
+}
+
+/* Sequential reads with a stray POUT toggle after each, which must not drop the sectors read ahead */
+static void run_stray_read(uint32_t base, uint32_t total, uint32_t chunk)
+{
+	snapshot_t s;
+	uint32_t sector, ops = 0;
+	uint32_t hits, misses, dropped;
+
+	sd_get_prefetch_stats(&hits, &misses);
+	dropped = misses;
+	take_snapshot(&s);
+	for (sector = base; sector < base + total; sector += chunk) {
+		check_read(sector, chunk, sd_read(buf, sector, chunk));
+		sim_stray_toggle();
+		ops++;
+	}
+	sd_flush();
+	report("stray-read", &s, ops, total);
+	sd_get_prefetch_stats(&hits, &misses);
+	if (misses - dropped > 2) {
+		fprintf(stderr, "stray toggles dropped %u sectors read ahead\n", (unsigned int)(misses - dropped));
+		failures++;
+	}
+}
+
+static void run_rand_read(uint32_t ops)
+{
+	snapshot_t s;
+	uint32_t n, sector;
+
+	take_snapshot(&s);
+	for (n = 0; n < ops; n++) {
+		sector = rng() % image_sectors;
+		check_read(sector, 1, sd_read(buf, sector, 1));
+	}
+	sd_flush();
+	report("rand-read", &s, ops, ops);
+}
+
+/* Runs of single sector requests merged into one transfer, as the unit task in device.c does */
+static void run_merged_read(uint32_t ops, uint32_t run)
+{
+	sd_segment_t seg[MAX_CHUNK];
+	snapshot_t s;
+	uint32_t n, i, sector;
+
+	for (i = 0; i < run; i++) {
+		seg[i].buf = buf + i * SD_SECTOR_SIZE;
+		seg[i].count = 1;
+	}
+
+	take_snapshot(&s);
+	for (n = 0; n < ops; n++) {
+		sector = rng() % (image_sectors - run);
+		check_read(sector, run, sd_read_segments(sector, seg, run));
+	}
+	sd_flush();
+	report("merged-read", &s, ops * run, ops * run);
+}
+
+static void run_seq_write(uint32_t base, uint32_t total, uint32_t chunk, uint32_t seed)
+{
+	snapshot_t s;
+	uint32_t sector, ops = 0;
+
+	take_snapshot(&s);
+	for (sector = base; sector < base + total; sector += chunk) {
+		fill_pattern(buf, sector, chunk, seed);
+		check_write(sector, chunk, sd_write(buf, sector, chunk));
+		ops++;
+	}
+	sd_flush();
+	report("seq-write", &s, ops, total);
+}
+
+static void run_rand_write(uint32_t ops, uint32_t seed)
+{
+	snapshot_t s;
+	uint32_t n, sector;
+
+	take_snapshot(&s);
+	for (n = 0; n < ops; n++) {
+		/* Keep clear of the sequential write area checked by verify_written() */
+		sector = rng() % (image_sectors / 2);
+		fill_pattern(buf, sector, 1, seed);
+		check_write(sector, 1, sd_write(buf, sector, 1));
+	}
+	sd_flush();
+	report("rand-write", &s, ops, ops);
+}
+
+static void verify_written(uint32_t base, uint32_t total, uint32_t chunk, uint32_t seed)
+{
+	uint32_t sector;
+
+	for (sector = base; sector < base + total; sector += chunk) {
+		read_image(ref, sector, chunk);
+		fill_pattern(buf, sector, chunk, seed);
+		if (memcmp(buf, ref, chunk * SD_SECTOR_SIZE) != 0) {
+			fprintf(stderr, "image contents wrong after sd_write(%u, %u)\n", (unsigned int)sector, (unsigned int)chunk);
+			failures++;
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [options] image\n"
+			"  -s mb      size of image to create if missing (default 64)\n"
+			"  -c n       sectors per sequential request (default 32, max %d)\n"
+			"  -k kb      amount of data for sequential workloads (default 4096)\n"
+			"  -n n       number of random requests (default 500)\n"
+			"  -t us      card read access time to first data token (default 500)\n"
+			"  -T us      token latency between blocks of CMD18 (default 100)\n"
+			"  -b us      write busy time, single block or first of CMD25 (default 1000)\n"
+			"  -B us      write busy time, following blocks of CMD25 (default 200)\n"
+			"  -g us      busy after CMD12/STOP_TRAN (default 300)\n"
+			"  -x us      per transaction overhead on the parallel port (default 60)\n"
+			"  -y ns      per byte time on the parallel port (default 2800)\n"
+			"  -i bytes   maximum bytes per transfer with interrupts disabled (default no limit)\n"
+			"  -e caps    adapter capabilities to emulate, SPI_CAP_* bits (default 0)\n"
+			"  -p us      host time between sequential read requests (default 0)\n",
+			prog, MAX_CHUNK);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	sdcard_timing_t card_timing = {
+		.token_ns = 500000,
+		.stream_token_ns = 100000,
+		.busy_ns = 1000000,
+		.stream_busy_ns = 200000,
+		.cmd12_ns = 300000,
+		.init_polls = 20,
+	};
+	sim_port_timing_t port_timing = {
+		.xfer_ns = 60000,
+		.byte_ns = 2800,
+		.slow_byte_ns = 45000,
+		.spi_byte_ns = 1100,
+		.spi_slow_byte_ns = 32000,
+		.cs_ns = 1400,
+		.tick_ns = 4200,
+	};
+	uint32_t size_mb = 64, chunk = 32, seq_kb = 4096, rand_ops = 500, irq_chunk = 0, caps = 0;
+	uint32_t seq_total, seq_base;
+	struct stat st;
+	snapshot_t s;
+	uint32_t hits, misses;
+	int opt, err;
+
+	while ((opt = getopt(argc, argv, "s:c:k:n:t:T:b:B:g:x:y:i:e:p:")) != -1) {
+		switch (opt) {
+		case 's': size_mb = strtoul(optarg, NULL, 0); break;
+		case 'c': chunk = strtoul(optarg, NULL, 0); break;
+		case 'k': seq_kb = strtoul(optarg, NULL, 0); break;
+		case 'n': rand_ops = strtoul(optarg, NULL, 0); break;
+		case 't': card_timing.token_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'T': card_timing.stream_token_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'b': card_timing.busy_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'B': card_timing.stream_busy_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'g': card_timing.cmd12_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'x': port_timing.xfer_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'y': port_timing.byte_ns = strtoull(optarg, NULL, 0); break;
+		case 'i': irq_chunk = strtoul(optarg, NULL, 0); break;
+		case 'e': caps = strtoul(optarg, NULL, 0); break;
+		case 'p': host_ns = strtoull(optarg, NULL, 0) * 1000; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || chunk == 0 || chunk > MAX_CHUNK) {
+		usage(argv[0]);
+	}
+
+	if (stat(argv[optind], &st) != 0) {
+		image = fopen(argv[optind], "w+b");
+		if (image == NULL || ftruncate(fileno(image), (off_t)size_mb << 20) != 0) {
+			perror(argv[optind]);
+			return 1;
+		}
+		image_sectors = size_mb << 11;
+	} else {
+		image = fopen(argv[optind], "r+b");
+		if (image == NULL) {
+			perror(argv[optind]);
+			return 1;
+		}
+		image_sectors = (uint32_t)(st.st_size / SD_SECTOR_SIZE);
+	}
+
+	card = sdcard_create(image, image_sectors, &card_timing);
+	if (card == NULL) {
+		return 1;
+	}
+	sim_attach(card, &port_timing);
+	sim_set_caps(caps);
+
+	seq_total = (seq_kb * 2 / chunk) * chunk;
+	if (seq_total == 0 || seq_total > image_sectors / 2) {
+		fprintf(stderr, "sequential workload does not fit in the image\n");
+		return 1;
+	}
+	seq_base = image_sectors / 2;
+
+	print_header();
+
+	spi_init();
+	spi_set_max_transfer(irq_chunk);
+	spi_set_sleep(bench_sleep);
+	timer_set_sleep(bench_delay);
+	prof_start();
+	take_snapshot(&s);
+	err = sd_open();
+	report("init", &s, 1, 0);
+	if (err != 0) {
+		fprintf(stderr, "sd_open failed: %d\n", err);
+		return 1;
+	}
+	if (sd_get_card_info()->capacity != (uint64_t)image_sectors * SD_SECTOR_SIZE) {
+		fprintf(stderr, "card capacity mismatch\n");
+		failures++;
+	}
+
+	run_seq_read(0, seq_total, chunk);
+	run_stray_read(0, seq_total, chunk);
+	run_rand_read(rand_ops);
+	run_merged_read(rand_ops / 8, 8);
+	run_seq_write(seq_base, seq_total, chunk, 1);
+	run_rand_write(rand_ops, 2);
+	run_seq_read(seq_base, seq_total, chunk);
+	verify_written(seq_base, seq_total, chunk, 1);
+	printf("interrupts disabled for up to %u us\n", (unsigned int)spi_get_max_disabled_us());
+	sd_get_prefetch_stats(&hits, &misses);
+	printf("sectors read ahead by the adapter: %u used, %u dropped\n", (unsigned int)hits, (unsigned int)misses);
+	printf("slept %u ms waiting for the adapter, %u times\n",
+			(unsigned int)(sim_get_port_stats()->sleep_ns / 1000000), (unsigned int)sleeps);
+	printf("slept %u ms in long waits, %u times\n", (unsigned int)(delay_ns / 1000000), (unsigned int)delays);
+	print_profile();
+
+	sdcard_destroy(card);
+	fclose(image);
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,386 @@
+/*
+ * cachetest - host test of cache.c against a simulated SD card
+ *
+ * Reads and writes through the sector cache the way device.c does, and
+ * checks the data seen by the caller and the data on the card image around
+ * evictions and flushes: write-back, the dirty limit, the split between
+ * FAT metadata and file data, and the coalescing of consecutive dirty
+ * sectors into one multiple-block write by cache_flush().
+ *
+ * Usage: cachetest
+ * Returns 0 if every check passes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "sd.h"
+#include "spi-par.h"
+#include "cache.h"
+#include "sim.h"
+
+#define CACHE_KB			32
+#define CACHE_ENTRIES		(CACHE_KB * 1024 / SD_SECTOR_SIZE)
+#define MAX_DIRTY			(CACHE_ENTRIES * CACHE_DIRTY_PERCENT / 100)
+#define MAX_META			(CACHE_ENTRIES * CACHE_META_PERCENT / 100)
+#define IMAGE_SECTORS		16384
+
+/* FAT32 volume of the metadata test: boot sector, 32 reserved sectors and two FATs of 16 sectors */
+#define VOLUME_START		64
+#define VOLUME_META_END		(VOLUME_START + 32 + 2 * 16)
+
+#define CHECK(cond, ...)	do { if (!(cond)) { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); failures++; } } while (0)
+
+static sdcard_t *card;
+static FILE *image;
+static int failures;
+static bool write_back;
+
+static uint8_t buf[CACHE_MAX_RUN * SD_SECTOR_SIZE];
+static uint8_t ref[SD_SECTOR_SIZE];
+
+/* sd_write_segments() calls, the test is linked with --wrap=sd_write_segments.
+ * sd.c continues an open CMD25 across adjacent runs, so the card's command
+ * counts alone cannot show how cache_flush() split them. */
+static uint32_t write_calls;
+
+int __real_sd_write_segments(uint32_t sector, const sd_segment_t *seg, unsigned int nseg);
+
+int __wrap_sd_write_segments(uint32_t sector, const sd_segment_t *seg, unsigned int nseg)
+{
+	write_calls++;
+	return __real_sd_write_segments(sector, seg, nseg);
+}
+
+/* Contents of a sector written in generation 'gen', 0 is the zero filled image */
+static void fill(uint8_t *p, uint32_t sector, uint32_t gen)
+{
+	unsigned int n;
+
+	for (n = 0; n < SD_SECTOR_SIZE; n++) {
+		p[n] = gen ? (uint8_t)(sector * 7 + gen * 13 + n) : 0;
+	}
+}
+
+static bool card_has(uint32_t sector, uint32_t gen)
+{
+	uint8_t on_card[SD_SECTOR_SIZE];
+
+	fill(ref, sector, gen);
+	fseeko(image, (off_t)sector * SD_SECTOR_SIZE, SEEK_SET);
+	return fread(on_card, SD_SECTOR_SIZE, 1, image) == 1 && memcmp(on_card, ref, SD_SECTOR_SIZE) == 0;
+}
+
+static void card_put(const uint8_t *p, uint32_t sector)
+{
+	fseeko(image, (off_t)sector * SD_SECTOR_SIZE, SEEK_SET);
+	fwrite(p, SD_SECTOR_SIZE, 1, image);
+	fflush(image);
+}
+
+/* CMD_WRITE as device_do_rw() does it */
+static void dev_write(uint32_t sector, uint32_t count, uint32_t gen)
+{
+	uint32_t n;
+
+	for (n = 0; n < count; n++) {
+		fill(buf + n * SD_SECTOR_SIZE, sector + n, gen);
+	}
+	if (write_back && cache_write(buf, sector, count, true)) {
+		return;
+	}
+	CHECK(sd_write(buf, sector, count) == 0, "sd_write %u failed", (unsigned int)sector);
+	cache_write(buf, sector, count, false);
+}
+
+/* CMD_READ as device_do_rw() does it, returns true for a cache hit */
+static bool dev_read(uint32_t sector, uint32_t count)
+{
+	if (cache_read(buf, sector, count)) {
+		return true;
+	}
+	CHECK(sd_read(buf, sector, count) == 0, "sd_read %u failed", (unsigned int)sector);
+	cache_store(buf, sector, count);
+	return false;
+}
+
+/* Reads a sector and checks that the caller sees generation 'gen' */
+static void check_read(uint32_t sector, uint32_t gen, const char *what)
+{
+	dev_read(sector, 1);
+	fill(ref, sector, gen);
+	CHECK(memcmp(buf, ref, SD_SECTOR_SIZE) == 0, "%s: sector %u reads wrong data", what, (unsigned int)sector);
+}
+
+/* True if the sector is cached, without reading the card */
+static bool cached(uint32_t sector)
+{
+	uint8_t tmp[SD_SECTOR_SIZE];
+
+	return cache_read(tmp, sector, 1);
+}
+
+static void reset_cache(bool wb)
+{
+	CHECK(cache_init(CACHE_KB) == 0, "cache_init failed");
+	write_back = wb;
+}
+
+/* A written sector is held, read back from the cache, and written once by the flush */
+static void test_write_back(void)
+{
+	sdcard_stats_t before = *sdcard_get_stats(card);
+	uint32_t n;
+
+	reset_cache(true);
+	dev_write(1000, 4, 1);
+	CHECK(sdcard_get_stats(card)->blocks_written == before.blocks_written, "write-back: held sectors were written");
+	for (n = 0; n < 4; n++) {
+		CHECK(card_has(1000 + n, 0), "write-back: sector %u on the card before the flush", (unsigned int)(1000 + n));
+		check_read(1000 + n, 1, "write-back");
+	}
+
+	/* A read that misses on one sector gets the held data for the others */
+	CHECK(!dev_read(999, 2), "write-back: sector 999 should miss");
+	fill(ref, 1000, 1);
+	CHECK(memcmp(buf + SD_SECTOR_SIZE, ref, SD_SECTOR_SIZE) == 0, "write-back: miss returned the card's old sector 1000");
+
+	CHECK(cache_flush() == 0, "write-back: flush failed");
+	for (n = 0; n < 4; n++) {
+		CHECK(card_has(1000 + n, 1), "write-back: sector %u not on the card after the flush", (unsigned int)(1000 + n));
+	}
+	CHECK(sdcard_get_stats(card)->blocks_written == before.blocks_written + 4, "write-back: flush wrote %u blocks",
+			(unsigned int)(sdcard_get_stats(card)->blocks_written - before.blocks_written));
+	CHECK(cache_flush() == 0 && sdcard_get_stats(card)->blocks_written == before.blocks_written + 4,
+			"write-back: second flush wrote clean sectors");
+}
+
+/* Going over the dirty limit flushes, and no sector is lost or written twice */
+static void test_dirty_limit(void)
+{
+	sdcard_stats_t before = *sdcard_get_stats(card);
+	uint32_t n, count = MAX_DIRTY + 8;
+
+	reset_cache(true);
+	for (n = 0; n < count; n++) {
+		dev_write(2000 + 2 * n, 1, 2);
+	}
+	CHECK(card_has(2000, 2), "dirty limit: nothing flushed after %u dirty sectors", (unsigned int)count);
+	CHECK(card_has(2000 + 2 * (count - 1), 0), "dirty limit: last sector already on the card");
+	for (n = 0; n < count; n++) {
+		check_read(2000 + 2 * n, 2, "dirty limit");
+	}
+	CHECK(cache_flush() == 0, "dirty limit: flush failed");
+	for (n = 0; n < count; n++) {
+		CHECK(card_has(2000 + 2 * n, 2), "dirty limit: sector %u lost", (unsigned int)(2000 + 2 * n));
+	}
+	CHECK(sdcard_get_stats(card)->blocks_written == before.blocks_written + count, "dirty limit: %u blocks written for %u sectors",
+			(unsigned int)(sdcard_get_stats(card)->blocks_written - before.blocks_written), (unsigned int)count);
+}
+
+/* Dirty sectors survive any amount of clean traffic */
+static void test_eviction(void)
+{
+	uint32_t n;
+
+	reset_cache(true);
+	dev_write(3000, 8, 3);
+	for (n = 0; n < 4 * CACHE_ENTRIES; n++) {
+		dev_read(4000 + n, 1);
+	}
+	for (n = 0; n < 8; n++) {
+		CHECK(cached(3000 + n), "eviction: dirty sector %u was recycled", (unsigned int)(3000 + n));
+		check_read(3000 + n, 3, "eviction");
+		CHECK(card_has(3000 + n, 0), "eviction: sector %u on the card before the flush", (unsigned int)(3000 + n));
+	}
+	CHECK(cache_flush() == 0, "eviction: flush failed");
+	for (n = 0; n < 8; n++) {
+		CHECK(card_has(3000 + n, 3), "eviction: sector %u not on the card after the flush", (unsigned int)(3000 + n));
+	}
+
+	/* Recycled once clean */
+	for (n = 0; n < 4 * CACHE_ENTRIES; n++) {
+		dev_read(4000 + n, 1);
+	}
+	CHECK(!cached(3000), "eviction: clean sector 3000 never recycled");
+}
+
+/* An MBR with one FAT32 partition and its boot sector */
+static void make_volume(void)
+{
+	uint8_t p[SD_SECTOR_SIZE];
+
+	memset(p, 0, sizeof(p));
+	p[446 + 4] = 0x0c;
+	p[446 + 8] = VOLUME_START;
+	p[510] = 0x55;
+	p[511] = 0xaa;
+	card_put(p, 0);
+
+	memset(p, 0, sizeof(p));
+	p[11] = SD_SECTOR_SIZE & 0xff;
+	p[12] = SD_SECTOR_SIZE >> 8;
+	p[13] = 8;										/* sectors per cluster */
+	p[14] = 32;										/* reserved sectors */
+	p[16] = 2;										/* FATs */
+	p[36] = 16;										/* sectors per FAT */
+	p[510] = 0x55;
+	p[511] = 0xaa;
+	card_put(p, VOLUME_START);
+}
+
+static uint32_t count_cached(uint32_t first, uint32_t end)
+{
+	uint32_t n, found = 0;
+
+	for (n = first; n < end; n++) {
+		found += cached(n);
+	}
+	return found;
+}
+
+/* Metadata keeps its share against file data, and file data never takes it */
+static void test_meta(void)
+{
+	uint32_t n, meta;
+
+	make_volume();
+	reset_cache(true);
+	dev_read(0, 1);
+	for (n = VOLUME_START; n < VOLUME_META_END; n++) {
+		dev_read(n, 1);
+	}
+	for (n = 0; n < 4 * CACHE_ENTRIES; n++) {
+		dev_read(8000 + n, 1);
+	}
+	meta = cached(0) + count_cached(VOLUME_START, VOLUME_META_END);
+	CHECK(meta == MAX_META, "meta: %u metadata sectors cached after file reads, expected %u",
+			(unsigned int)meta, (unsigned int)MAX_META);
+	CHECK(count_cached(8000 + 4 * CACHE_ENTRIES - (CACHE_ENTRIES - MAX_META), 8000 + 4 * CACHE_ENTRIES) == CACHE_ENTRIES - MAX_META,
+			"meta: the latest file sectors are not cached");
+
+	/* With every file data entry dirty, a file read is not cached and a
+	 * file write flushes to find an entry, metadata stays */
+	for (n = 0; n < CACHE_ENTRIES - MAX_META; n++) {
+		dev_write(9000 + n, 1, 4);
+	}
+	CHECK(!dev_read(9500, 1) && !cached(9500), "meta: file read displaced metadata");
+	dev_write(9600, 1, 4);
+	CHECK(cached(9600), "meta: file write not held");
+	for (n = 0; n < CACHE_ENTRIES - MAX_META; n++) {
+		CHECK(card_has(9000 + n, 4), "meta: sector %u not flushed", (unsigned int)(9000 + n));
+	}
+	meta = cached(0) + count_cached(VOLUME_START, VOLUME_META_END);
+	CHECK(meta == MAX_META, "meta: %u metadata sectors cached after file writes, expected %u",
+			(unsigned int)meta, (unsigned int)MAX_META);
+	CHECK(cache_flush() == 0 && card_has(9600, 4), "meta: sector 9600 not flushed");
+
+	/* Written metadata is held like file data */
+	dev_write(VOLUME_START + 1, 1, 5);
+	CHECK(card_has(VOLUME_START + 1, 0), "meta: written metadata on the card before the flush");
+	check_read(VOLUME_START + 1, 5, "meta");
+	CHECK(cache_flush() == 0 && card_has(VOLUME_START + 1, 5), "meta: written metadata not flushed");
+}
+
+/* A flush writes each run of consecutive sectors with one call and one CMD25 */
+static void test_coalescing(void)
+{
+	static const uint32_t order[] = { 5005, 5001, 5002, 5000, 5003, 5010, 5004, 5011, 5020 };
+	sdcard_stats_t before, after;
+	uint32_t calls;
+	unsigned int n;
+
+	reset_cache(true);
+	for (n = 0; n < ARRAY_SIZE(order); n++) {
+		dev_write(order[n], 1, 6);
+	}
+	before = *sdcard_get_stats(card);
+	calls = write_calls;
+	CHECK(cache_flush() == 0, "coalescing: flush failed");
+	after = *sdcard_get_stats(card);
+	CHECK(write_calls - calls == 3, "coalescing: %u writes for runs of 6, 2 and 1", (unsigned int)(write_calls - calls));
+	CHECK(after.cmd[25] - before.cmd[25] == 2 && after.cmd[24] - before.cmd[24] == 1,
+			"coalescing: %u CMD25 and %u CMD24 for runs of 6, 2 and 1",
+			(unsigned int)(after.cmd[25] - before.cmd[25]), (unsigned int)(after.cmd[24] - before.cmd[24]));
+	CHECK(after.blocks_written - before.blocks_written == ARRAY_SIZE(order), "coalescing: %u blocks written",
+			(unsigned int)(after.blocks_written - before.blocks_written));
+	for (n = 0; n < ARRAY_SIZE(order); n++) {
+		CHECK(card_has(order[n], 6), "coalescing: sector %u not on the card", (unsigned int)order[n]);
+	}
+}
+
+/* Without write-back every write goes to the card and updates the cache */
+static void test_write_through(void)
+{
+	reset_cache(false);
+	dev_read(6000, 1);
+	dev_write(6000, 1, 7);
+	CHECK(card_has(6000, 7), "write-through: sector 6000 not on the card");
+	CHECK(cached(6000), "write-through: sector 6000 not cached");
+	check_read(6000, 7, "write-through");
+}
+
+static void bench_sleep(unsigned int timeout_ms)
+{
+	(void)timeout_ms;
+}
+
+int main(void)
+{
+	sdcard_timing_t card_timing = {
+		.token_ns = 500000,
+		.stream_token_ns = 100000,
+		.busy_ns = 1000000,
+		.stream_busy_ns = 200000,
+		.cmd12_ns = 300000,
+		.init_polls = 20,
+	};
+	sim_port_timing_t port_timing = {
+		.xfer_ns = 60000,
+		.byte_ns = 2800,
+		.slow_byte_ns = 45000,
+		.spi_byte_ns = 1100,
+		.spi_slow_byte_ns = 32000,
+		.cs_ns = 1400,
+		.tick_ns = 4200,
+	};
+
+	image = tmpfile();
+	if (image == NULL || ftruncate(fileno(image), (off_t)IMAGE_SECTORS * SD_SECTOR_SIZE) != 0) {
+		perror("tmpfile");
+		return 1;
+	}
+	card = sdcard_create(image, IMAGE_SECTORS, &card_timing);
+	if (card == NULL) {
+		return 1;
+	}
+	sim_attach(card, &port_timing);
+	sim_set_caps(0);
+
+	spi_init();
+	spi_set_sleep(bench_sleep);
+	if (sd_open() != 0) {
+		fprintf(stderr, "sd_open failed\n");
+		return 1;
+	}
+
+	test_write_back();
+	test_dirty_limit();
+	test_eviction();
+	test_meta();
+	test_coalescing();
+	test_write_through();
+
+	cache_shutdown();
+	sdcard_destroy(card);
+	fclose(image);
+
+	if (failures) {
+		fprintf(stderr, "%d failures\n", failures);
+		return 1;
+	}
+	printf("cache tests passed\n");
+	return 0;
+}
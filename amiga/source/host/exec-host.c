@@ -0,0 +1,59 @@
+/*
+ * Host implementation of the exec and amiga.lib functions used by cache.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/lists.h>
+#include <proto/exec.h>
+#include <proto/alib.h>
+
+APTR AllocMem(ULONG size, ULONG flags)
+{
+	return (flags & MEMF_CLEAR) ? calloc(1, size) : malloc(size);
+}
+
+void FreeMem(APTR mem, ULONG size)
+{
+	(void)size;
+	free(mem);
+}
+
+void CopyMem(APTR src, APTR dst, ULONG size)
+{
+	memmove(dst, src, size);
+}
+
+/* The list is empty when lh_Head points at lh_Tail, which is always NULL,
+ * and lh_TailPred at the list itself */
+void NewList(struct List *list)
+{
+	list->lh_Head = (struct Node*)&list->lh_Tail;
+	list->lh_Tail = NULL;
+	list->lh_TailPred = (struct Node*)&list->lh_Head;
+}
+
+void AddHead(struct List *list, struct Node *node)
+{
+	node->ln_Succ = list->lh_Head;
+	node->ln_Pred = (struct Node*)&list->lh_Head;
+	list->lh_Head->ln_Pred = node;
+	list->lh_Head = node;
+}
+
+void AddTail(struct List *list, struct Node *node)
+{
+	node->ln_Succ = (struct Node*)&list->lh_Tail;
+	node->ln_Pred = list->lh_TailPred;
+	list->lh_TailPred->ln_Succ = node;
+	list->lh_TailPred = node;
+}
+
+void Remove(struct Node *node)
+{
+	node->ln_Pred->ln_Succ = node->ln_Succ;
+	node->ln_Succ->ln_Pred = node->ln_Pred;
+}
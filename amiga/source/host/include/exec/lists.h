@@ -0,0 +1,38 @@
+/*
+ * Host stand-in for exec lists. Only the link fields that MinNode/MinList
+ * share with Node/List are used, so either can be passed as the other.
+ */
+
+#ifndef HOST_EXEC_LISTS_H_
+#define HOST_EXEC_LISTS_H_
+
+#include <exec/types.h>
+
+struct Node {
+	struct Node		*ln_Succ;
+	struct Node		*ln_Pred;
+	UBYTE			ln_Type;
+	BYTE			ln_Pri;
+	char			*ln_Name;
+};
+
+struct MinNode {
+	struct MinNode	*mln_Succ;
+	struct MinNode	*mln_Pred;
+};
+
+struct List {
+	struct Node		*lh_Head;
+	struct Node		*lh_Tail;
+	struct Node		*lh_TailPred;
+	UBYTE			lh_Type;
+	UBYTE			l_pad;
+};
+
+struct MinList {
+	struct MinNode	*mlh_Head;
+	struct MinNode	*mlh_Tail;
+	struct MinNode	*mlh_TailPred;
+};
+
+#endif /* HOST_EXEC_LISTS_H_ */
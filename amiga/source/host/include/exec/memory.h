@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for the exec memory flags
+ */
+
+#ifndef HOST_EXEC_MEMORY_H_
+#define HOST_EXEC_MEMORY_H_
+
+#define MEMF_PUBLIC		(1ul << 0)
+#define MEMF_CLEAR		(1ul << 16)
+
+#endif /* HOST_EXEC_MEMORY_H_ */
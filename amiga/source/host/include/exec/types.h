@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the exec types used by cache.c, see host/exec-host.c
+ */
+
+#ifndef HOST_EXEC_TYPES_H_
+#define HOST_EXEC_TYPES_H_
+
+typedef void *APTR;
+typedef unsigned long ULONG;
+typedef long LONG;
+typedef unsigned char UBYTE;
+typedef signed char BYTE;
+typedef char *STRPTR;
+
+#endif /* HOST_EXEC_TYPES_H_ */
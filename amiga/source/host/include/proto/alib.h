@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for the amiga.lib functions used by cache.c
+ */
+
+#ifndef HOST_PROTO_ALIB_H_
+#define HOST_PROTO_ALIB_H_
+
+#include <exec/lists.h>
+
+void NewList(struct List *list);
+
+#endif /* HOST_PROTO_ALIB_H_ */
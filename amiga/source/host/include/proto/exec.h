@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for the exec functions used by cache.c, see host/exec-host.c
+ */
+
+#ifndef HOST_PROTO_EXEC_H_
+#define HOST_PROTO_EXEC_H_
+
+#include <exec/types.h>
+#include <exec/lists.h>
+
+APTR AllocMem(ULONG size, ULONG flags);
+void FreeMem(APTR mem, ULONG size);
+void CopyMem(APTR src, APTR dst, ULONG size);
+void AddHead(struct List *list, struct Node *node);
+void AddTail(struct List *list, struct Node *node);
+void Remove(struct Node *node);
+
+#endif /* HOST_PROTO_EXEC_H_ */
@@ -0,0 +1,450 @@
+/*
+ * Simulated SPI-mode SD card backed by a disk image file
+ *
+ * The model is byte oriented: every byte clocked by the host is passed to
+ * sdcard_xfer() together with the modelled time at which it was clocked, and
+ * the byte the card would drive on MISO is returned. Only the subset of the
+ * SPI-mode protocol used by sd.c is implemented. The card always reports
+ * itself as SDHC (block addressing).
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "sdcard.h"
+
+#define SECTOR_SIZE			512
+
+#define R1_IDLE				0x01
+#define R1_ILLEGAL			0x04
+#define R1_PARAMETER		0x40
+
+#define DATA_ACCEPTED		0xe5
+
+typedef enum {
+	cardState_Idle = 0,			/* waiting for a command */
+	cardState_Command,			/* receiving a command frame */
+	cardState_Response,			/* shifting out queued response bytes */
+	cardState_ReadToken,		/* read access latency, MISO high */
+	cardState_ReadData,			/* shifting out data block and CRC */
+	cardState_WriteToken,		/* waiting for a data token from the host */
+	cardState_WriteData,		/* receiving data block and CRC */
+} card_state_t;
+
+struct sdcard {
+	FILE				*image;
+	uint32_t			sectors;
+	sdcard_timing_t		timing;
+	sdcard_stats_t		stats;
+
+	bool				selected;
+	bool				idle;
+	bool				app_cmd;
+	unsigned int		init_left;
+
+	card_state_t		state;
+	card_state_t		next_state;		/* state entered once the response queue drains */
+	uint64_t			busy_after_ns;	/* busy time started once the response queue drains */
+	uint64_t			busy_until;
+	uint64_t			ready_at;		/* time at which the next read token is available */
+
+	uint8_t				cmd[6];
+	unsigned int		cmd_len;
+
+	uint8_t				queue[8];
+	unsigned int		queue_pos;
+	unsigned int		queue_len;
+
+	uint8_t				block[SECTOR_SIZE + 2];
+	unsigned int		block_pos;
+	unsigned int		block_len;
+	bool				block_is_data;	/* false for CSD/CID register reads */
+	uint32_t			lba;
+	bool				multi;
+	uint32_t			stream_blocks;	/* blocks transferred by the current CMD18/CMD25 */
+};
+
+static void set_bits(uint8_t *reg, unsigned int msb, unsigned int width, uint32_t value)
+{
+	unsigned int n, bit;
+
+	for (n = 0; n < width; n++) {
+		bit = msb - width + 1 + n;
+		if (value & (1ul << n)) {
+			reg[15 - bit / 8] |= 1 << (bit % 8);
+		} else {
+			reg[15 - bit / 8] &= ~(1 << (bit % 8));
+		}
+	}
+}
+
+static void build_csd(sdcard_t *card, uint8_t *reg)
+{
+	memset(reg, 0, 16);
+	set_bits(reg, 127, 2, 1);					/* CSD version 2.0 */
+	set_bits(reg, 119, 8, 0x0e);				/* TAAC */
+	set_bits(reg, 103, 8, 0x32);				/* TRAN_SPEED */
+	set_bits(reg, 95, 12, 0x5b5);				/* CCC */
+	set_bits(reg, 83, 4, 9);					/* READ_BL_LEN */
+	set_bits(reg, 69, 22, card->sectors / 1024 - 1);	/* C_SIZE */
+	set_bits(reg, 46, 1, 1);					/* ERASE_BLK_EN */
+	set_bits(reg, 45, 7, 0x7f);					/* SECTOR_SIZE */
+	set_bits(reg, 28, 3, 2);					/* R2W_FACTOR */
+	set_bits(reg, 25, 4, 9);					/* WRITE_BL_LEN */
+	set_bits(reg, 0, 1, 1);
+}
+
+static void build_cid(uint8_t *reg)
+{
+	memset(reg, 0, 16);
+	reg[0] = 0x5a;								/* MID */
+	memcpy(&reg[1], "HS", 2);					/* OID */
+	memcpy(&reg[3], "SIMSD", 5);				/* PNM */
+	reg[8] = 0x10;								/* PRV */
+	reg[9] = 0x12;								/* PSN */
+	reg[10] = 0x34;
+	reg[11] = 0x56;
+	reg[12] = 0x78;
+	reg[13] = 0x01;								/* MDT */
+	reg[14] = 0x4a;
+	reg[15] = 0x01;
+}
+
+static void load_block(sdcard_t *card)
+{
+	memset(card->block, 0, SECTOR_SIZE);
+	fseeko(card->image, (off_t)card->lba * SECTOR_SIZE, SEEK_SET);
+	if (fread(card->block, SECTOR_SIZE, 1, card->image) != 1) {
+		fprintf(stderr, "sdcard: short read at sector %u\n", (unsigned int)card->lba);
+	}
+	card->block[SECTOR_SIZE] = 0xff;
+	card->block[SECTOR_SIZE + 1] = 0xff;
+	card->block_len = SECTOR_SIZE + 2;
+	card->block_pos = 0;
+	card->block_is_data = true;
+}
+
+static void store_block(sdcard_t *card)
+{
+	fseeko(card->image, (off_t)card->lba * SECTOR_SIZE, SEEK_SET);
+	if (fwrite(card->block, SECTOR_SIZE, 1, card->image) != 1) {
+		fprintf(stderr, "sdcard: short write at sector %u\n", (unsigned int)card->lba);
+	}
+}
+
+static void respond(sdcard_t *card, const uint8_t *bytes, unsigned int len, card_state_t next, uint64_t busy_ns)
+{
+	memcpy(card->queue, bytes, len);
+	card->queue_pos = 0;
+	card->queue_len = len;
+	card->next_state = next;
+	card->busy_after_ns = busy_ns;
+	card->state = cardState_Response;
+}
+
+static void respond_r1(sdcard_t *card, uint8_t r1, card_state_t next)
+{
+	uint8_t resp[2] = {0xff, r1};		/* one byte of NCR, then R1 */
+
+	respond(card, resp, sizeof(resp), next, 0);
+}
+
+static void execute(sdcard_t *card, uint64_t now_ns)
+{
+	uint8_t idx = card->cmd[0] & 0x3f;
+	uint32_t arg = ((uint32_t)card->cmd[1] << 24) | ((uint32_t)card->cmd[2] << 16) |
+			((uint32_t)card->cmd[3] << 8) | (uint32_t)card->cmd[4];
+	bool app = card->app_cmd;
+	uint8_t r1 = card->idle ? R1_IDLE : 0;
+	uint8_t resp[6];
+
+	card->app_cmd = false;
+	if (app) {
+		card->stats.acmd[idx]++;
+	} else {
+		card->stats.cmd[idx]++;
+	}
+
+	if (app) {
+		switch (idx) {
+		case 41:
+			if (card->init_left) {
+				card->init_left--;
+			} else {
+				card->idle = false;
+			}
+			respond_r1(card, card->idle ? R1_IDLE : 0, cardState_Idle);
+			return;
+		case 23:
+			respond_r1(card, r1, cardState_Idle);
+			return;
+		default:
+			break;
+		}
+	}
+
+	switch (idx) {
+	case 0:
+		card->idle = true;
+		card->init_left = card->timing.init_polls;
+		respond_r1(card, R1_IDLE, cardState_Idle);
+		break;
+	case 8:
+		resp[0] = 0xff;
+		resp[1] = r1;
+		resp[2] = 0;
+		resp[3] = 0;
+		resp[4] = (arg >> 8) & 0x0f;
+		resp[5] = arg & 0xff;
+		respond(card, resp, 6, cardState_Idle, 0);
+		break;
+	case 9:
+	case 10:
+		if (idx == 9) {
+			build_csd(card, card->block);
+		} else {
+			build_cid(card->block);
+		}
+		card->block[16] = 0xff;
+		card->block[17] = 0xff;
+		card->block_len = 18;
+		card->block_pos = 0;
+		card->block_is_data = false;
+		card->multi = false;
+		card->ready_at = now_ns + card->timing.token_ns;
+		respond_r1(card, r1, cardState_ReadToken);
+		break;
+	case 12:
+		resp[0] = 0xff;					/* stuff byte */
+		resp[1] = r1;
+		respond(card, resp, 2, cardState_Idle, card->timing.cmd12_ns);
+		break;
+	case 16:
+		respond_r1(card, arg == SECTOR_SIZE ? r1 : (r1 | R1_PARAMETER), cardState_Idle);
+		break;
+	case 17:
+	case 18:
+	case 24:
+	case 25:
+		if (card->idle) {
+			respond_r1(card, r1 | R1_ILLEGAL, cardState_Idle);
+		} else if (arg >= card->sectors) {
+			respond_r1(card, r1 | R1_PARAMETER, cardState_Idle);
+		} else {
+			card->lba = arg;
+			card->multi = (idx == 18 || idx == 25);
+			card->stream_blocks = 0;
+			if (idx == 17 || idx == 18) {
+				load_block(card);
+				card->ready_at = now_ns + card->timing.token_ns;
+				respond_r1(card, r1, cardState_ReadToken);
+			} else {
+				respond_r1(card, r1, cardState_WriteToken);
+			}
+		}
+		break;
+	case 55:
+		card->app_cmd = true;
+		respond_r1(card, r1, cardState_Idle);
+		break;
+	case 58:
+		resp[0] = 0xff;
+		resp[1] = r1;
+		resp[2] = card->idle ? 0x40 : 0xc0;	/* power up status, CCS */
+		resp[3] = 0xff;
+		resp[4] = 0x80;
+		resp[5] = 0x00;
+		respond(card, resp, 6, cardState_Idle, 0);
+		break;
+	default:
+		respond_r1(card, r1 | R1_ILLEGAL, cardState_Idle);
+		break;
+	}
+}
+
+/* Collects a command frame while the card is busy streaming read data.
+ * Returns true once CMD12 has been received. */
+static bool watch_stop(sdcard_t *card, uint8_t mosi)
+{
+	if (card->cmd_len == 0) {
+		if ((mosi & 0xc0) == 0x40) {
+			card->cmd[card->cmd_len++] = mosi;
+		}
+		return false;
+	}
+	card->cmd[card->cmd_len++] = mosi;
+	if (card->cmd_len < 6) {
+		return false;
+	}
+	card->cmd_len = 0;
+	if ((card->cmd[0] & 0x3f) != 12) {
+		return false;
+	}
+	card->stats.cmd[12]++;
+	return true;
+}
+
+uint8_t sdcard_xfer(sdcard_t *card, uint8_t mosi, uint64_t now_ns)
+{
+	uint8_t miso = 0xff;
+	uint8_t resp[2];
+
+	if (!card->selected) {
+		return 0xff;
+	}
+	if (now_ns < card->busy_until) {
+		/* Programming, MISO held low and input ignored */
+		return 0x00;
+	}
+
+	switch (card->state) {
+	case cardState_Idle:
+		if ((mosi & 0xc0) == 0x40) {
+			card->cmd[0] = mosi;
+			card->cmd_len = 1;
+			card->state = cardState_Command;
+		}
+		break;
+
+	case cardState_Command:
+		card->cmd[card->cmd_len++] = mosi;
+		if (card->cmd_len == 6) {
+			card->cmd_len = 0;
+			execute(card, now_ns);
+		}
+		break;
+
+	case cardState_Response:
+		if ((mosi & 0xc0) == 0x40) {
+			/* Host abandoned the rest of the response and sent a new command */
+			card->cmd[0] = mosi;
+			card->cmd_len = 1;
+			card->state = cardState_Command;
+			break;
+		}
+		miso = card->queue[card->queue_pos++];
+		if (card->queue_pos == card->queue_len) {
+			card->state = card->next_state;
+			if (card->busy_after_ns) {
+				card->busy_until = now_ns + card->busy_after_ns;
+			}
+		}
+		break;
+
+	case cardState_ReadToken:
+		if (card->multi && watch_stop(card, mosi)) {
+			resp[0] = 0xff;
+			resp[1] = 0x00;
+			respond(card, resp, 2, cardState_Idle, card->timing.cmd12_ns);
+			break;
+		}
+		if (now_ns >= card->ready_at) {
+			miso = 0xfe;
+			card->state = cardState_ReadData;
+		}
+		break;
+
+	case cardState_ReadData:
+		miso = card->block[card->block_pos++];
+		if (card->multi && watch_stop(card, mosi)) {
+			resp[0] = 0xff;
+			resp[1] = 0x00;
+			respond(card, resp, 2, cardState_Idle, card->timing.cmd12_ns);
+			break;
+		}
+		if (card->block_pos == card->block_len) {
+			if (card->block_is_data) {
+				card->stats.blocks_read++;
+			}
+			if (card->multi && card->lba + 1 < card->sectors) {
+				card->lba++;
+				card->stream_blocks++;
+				load_block(card);
+				card->ready_at = now_ns + card->timing.stream_token_ns;
+				card->state = cardState_ReadToken;
+			} else {
+				card->state = cardState_Idle;
+			}
+		}
+		break;
+
+	case cardState_WriteToken:
+		if ((mosi == 0xfe && !card->multi) || (mosi == 0xfc && card->multi)) {
+			card->block_pos = 0;
+			card->block_len = SECTOR_SIZE + 2;
+			card->state = cardState_WriteData;
+		} else if (mosi == 0xfd && card->multi) {
+			/* STOP_TRAN, busy starts with the next byte */
+			card->state = cardState_Idle;
+			card->busy_until = now_ns + card->timing.cmd12_ns;
+		} else if ((mosi & 0xc0) == 0x40) {
+			card->cmd[0] = mosi;
+			card->cmd_len = 1;
+			card->state = cardState_Command;
+		}
+		break;
+
+	case cardState_WriteData:
+		card->block[card->block_pos++] = mosi;
+		if (card->block_pos == card->block_len) {
+			store_block(card);
+			card->stats.blocks_written++;
+			resp[0] = DATA_ACCEPTED;
+			respond(card, resp, 1,
+					card->multi ? cardState_WriteToken : cardState_Idle,
+					card->stream_blocks ? card->timing.stream_busy_ns : card->timing.busy_ns);
+			card->lba++;
+			card->stream_blocks++;
+			if (card->multi && card->lba >= card->sectors) {
+				card->multi = false;
+				card->next_state = cardState_Idle;
+			}
+		}
+		break;
+	}
+
+	return miso;
+}
+
+void sdcard_set_selected(sdcard_t *card, bool selected)
+{
+	if (!selected) {
+		/* A partially received command is discarded */
+		card->cmd_len = 0;
+		if (card->state == cardState_Command) {
+			card->state = cardState_Idle;
+		}
+	}
+	card->selected = selected;
+}
+
+sdcard_stats_t *sdcard_get_stats(sdcard_t *card)
+{
+	return &card->stats;
+}
+
+sdcard_t *sdcard_create(FILE *image, uint32_t sectors, const sdcard_timing_t *timing)
+{
+	sdcard_t *card;
+
+	if (sectors < 1024 || (sectors & 1023)) {
+		fprintf(stderr, "sdcard: image size must be a non-zero multiple of 512 KiB\n");
+		return NULL;
+	}
+
+	card = calloc(1, sizeof(sdcard_t));
+	if (card == NULL) {
+		return NULL;
+	}
+	card->image = image;
+	card->sectors = sectors;
+	card->timing = *timing;
+	card->idle = true;
+	return card;
+}
+
+void sdcard_destroy(sdcard_t *card)
+{
+	free(card);
+}
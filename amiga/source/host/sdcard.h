@@ -0,0 +1,38 @@
+/*
+ * Simulated SPI-mode SD card backed by a disk image file
+ *
+ * Used by the host build (Makefile.host) to exercise sd.c without an Amiga.
+ */
+
+#ifndef HOST_SDCARD_H_
+#define HOST_SDCARD_H_
+
+#include <stdio.h>
+
+/*! Card side timing model, all values in nanoseconds */
+typedef struct {
+	uint64_t	token_ns;			/*!< command to data token, single block or first block of CMD18 */
+	uint64_t	stream_token_ns;	/*!< block to next data token within CMD18 */
+	uint64_t	busy_ns;			/*!< programming busy after CMD24 or first block of CMD25 */
+	uint64_t	stream_busy_ns;		/*!< programming busy after following blocks of CMD25 */
+	uint64_t	cmd12_ns;			/*!< busy after CMD12 or STOP_TRAN */
+	unsigned int	init_polls;		/*!< ACMD41 responses with the idle bit still set */
+} sdcard_timing_t;
+
+/*! Per-command counters kept by the card model */
+typedef struct {
+	uint32_t	cmd[64];			/*!< CMDn received */
+	uint32_t	acmd[64];			/*!< ACMDn received */
+	uint32_t	blocks_read;
+	uint32_t	blocks_written;
+} sdcard_stats_t;
+
+typedef struct sdcard sdcard_t;
+
+sdcard_t *sdcard_create(FILE *image, uint32_t sectors, const sdcard_timing_t *timing);
+void sdcard_destroy(sdcard_t *card);
+void sdcard_set_selected(sdcard_t *card, bool selected);
+uint8_t sdcard_xfer(sdcard_t *card, uint8_t mosi, uint64_t now_ns);
+sdcard_stats_t *sdcard_get_stats(sdcard_t *card);
+
+#endif /* HOST_SDCARD_H_ */
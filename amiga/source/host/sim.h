@@ -0,0 +1,47 @@
+/*
+ * Host implementation of the spi-par.h interface
+ *
+ * Replaces spi-par.c/spi-par-low.s in the host build. Every spi_read() and
+ * spi_write() is counted as one parallel port transaction and charged
+ * against a modelled clock, and the bytes are exchanged with a simulated SD
+ * card (sdcard.c). timer_get_tick_count() follows the same modelled clock so
+ * the timeouts in sd.c behave as they would on the Amiga. The extended
+ * commands of the adapter firmware are emulated for the capabilities set
+ * with sim_set_caps().
+ */
+
+#ifndef HOST_SIM_H_
+#define HOST_SIM_H_
+
+#include "sdcard.h"
+
+/*! Amiga side timing model, all values in nanoseconds */
+typedef struct {
+	uint64_t	xfer_ns;			/*!< per transaction: protocol header, wait_until_idle, Disable/Enable */
+	uint64_t	byte_ns;			/*!< per byte at spiSpeed_Fast */
+	uint64_t	slow_byte_ns;		/*!< per byte at spiSpeed_Slow */
+	uint64_t	spi_byte_ns;		/*!< per byte clocked by the AVR on its own (extended commands) */
+	uint64_t	spi_slow_byte_ns;	/*!< the same at spiSpeed_Slow */
+	uint64_t	cs_ns;				/*!< per chip select change */
+	uint64_t	tick_ns;			/*!< per timer_get_tick_count() (three CIA TOD reads) */
+} sim_port_timing_t;
+
+/*! Parallel port counters */
+typedef struct {
+	uint32_t	transactions;		/*!< spi_read/spi_write calls */
+	uint64_t	bytes;				/*!< payload bytes moved */
+	uint32_t	cs_changes;			/*!< spi_select/spi_deselect calls */
+	uint64_t	sleep_ns;			/*!< time slept waiting for ACK pulses (SPI_CAP_NOTIFY) */
+} sim_port_stats_t;
+
+void sim_attach(sdcard_t *card, const sim_port_timing_t *timing);
+void sim_set_caps(uint8_t caps);
+uint64_t sim_get_time_ns(void);
+void sim_advance_ns(uint64_t ns);
+void sim_charge_tick_read(void);
+sim_port_stats_t *sim_get_port_stats(void);
+
+/*! A stray POUT toggle after BUSY dropped, which the adapter reads as the no-op command 0xff */
+void sim_stray_toggle(void);
+
+#endif /* HOST_SIM_H_ */
@@ -0,0 +1,699 @@
+/*
+ * Host implementation of the spi-par.h interface driving a simulated SD card
+ */
+
+#include <string.h>
+
+#include "common.h"
+#include "spi-par.h"
+#include "sim.h"
+
+static sdcard_t *card;
+static sim_port_timing_t port_timing;
+static sim_port_stats_t port_stats;
+static uint64_t now_ns;
+
+static spi_speed_t current_speed = spiSpeed_Slow;
+static uint8_t firmware_caps;	/* emulated firmware, sim_set_caps() */
+static uint8_t caps;			/* found by spi_probe() */
+static unsigned int max_transfer;
+static uint64_t max_disabled_ns;
+static spi_sleep_t sleep_fn;
+static uint32_t notify_count;
+
+static void ahead_pause(bool keep);
+
+void sim_attach(sdcard_t *c, const sim_port_timing_t *timing)
+{
+	card = c;
+	port_timing = *timing;
+}
+
+void sim_set_caps(uint8_t c)
+{
+	firmware_caps = c;
+}
+
+uint64_t sim_get_time_ns(void)
+{
+	return now_ns;
+}
+
+void sim_advance_ns(uint64_t ns)
+{
+	now_ns += ns;
+}
+
+void sim_charge_tick_read(void)
+{
+	now_ns += port_timing.tick_ns;
+}
+
+sim_port_stats_t *sim_get_port_stats(void)
+{
+	return &port_stats;
+}
+
+static uint8_t exchange(uint8_t mosi)
+{
+	now_ns += (current_speed == spiSpeed_Fast) ? port_timing.byte_ns : port_timing.slow_byte_ns;
+	port_stats.bytes++;
+	return sdcard_xfer(card, mosi, now_ns);
+}
+
+void spi_init(void)
+{
+	current_speed = spiSpeed_Slow;
+	caps = 0;
+}
+
+void spi_shutdown(void)
+{
+}
+
+void spi_set_speed(spi_speed_t speed)
+{
+	ahead_pause(false);
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	current_speed = speed;
+}
+
+void spi_select(void)
+{
+	now_ns += port_timing.cs_ns;
+	port_stats.cs_changes++;
+	sdcard_set_selected(card, true);
+}
+
+void spi_deselect(void)
+{
+	now_ns += port_timing.cs_ns;
+	port_stats.cs_changes++;
+	sdcard_set_selected(card, false);
+}
+
+/* A byte clocked by the AVR without the Amiga taking part */
+static unsigned int lockstep;	/* card bytes paced by port bytes, buffered sector transfers */
+
+static uint8_t avr_exchange(uint8_t mosi)
+{
+	uint64_t ns = (current_speed == spiSpeed_Fast) ? port_timing.spi_byte_ns : port_timing.spi_slow_byte_ns;
+
+	if (lockstep) {
+		lockstep--;
+		if (port_timing.byte_ns > ns) {
+			ns = port_timing.byte_ns;
+		}
+	}
+	now_ns += ns;
+	return sdcard_xfer(card, mosi, now_ns);
+}
+
+/* Parameter and reply bytes of an extended command, moved by the C code in spi-par.c */
+static void ext_port_bytes(unsigned int n)
+{
+	now_ns += n * port_timing.byte_ns;
+	port_stats.bytes += n;
+}
+
+void spi_command(const uint8_t *frame, bool skip, unsigned int polls,
+		uint8_t *resp, unsigned int extra)
+{
+	unsigned int i;
+
+	ahead_pause(false);
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	ext_port_bytes(2 + SPI_COMMAND_FRAME);
+
+	for (i = 0; i < SPI_COMMAND_FRAME; i++) {
+		avr_exchange(frame[i]);
+	}
+	if (skip) {
+		avr_exchange(0xff);
+	}
+	do {
+		resp[0] = avr_exchange(0xff);
+	} while ((resp[0] & 0x80) && --polls);
+	for (i = 1; i <= extra; i++) {
+		resp[i] = avr_exchange(0xff);
+	}
+
+	ext_port_bytes(1 + extra);
+}
+
+static bool notify_on(void)
+{
+	return (caps & SPI_CAP_NOTIFY) && sleep_fn;
+}
+
+/* The Amiga sleeps from start until the ACK pulse, BUSY dropping now */
+static void notify_sleep(uint64_t start, unsigned int timeout_ms)
+{
+	if (now_ns > start) {
+		sleep_fn(timeout_ms);
+		port_stats.sleep_ns += now_ns - start;
+	}
+}
+
+/* Clocks in bytes on the AVR until one is 0xff (ready) or is not (token) */
+static uint8_t avr_wait(bool ready, unsigned int timeout_ms)
+{
+	uint64_t end = now_ns + (uint64_t)timeout_ms * 1000000;
+	uint8_t in;
+
+	do {
+		in = avr_exchange(0xff);
+	} while ((in == 0xff) != ready && now_ns < end);
+
+	return in;
+}
+
+static uint8_t ext_wait(bool ready, unsigned int timeout_ms)
+{
+	bool notify = notify_on();
+	uint64_t start;
+	uint8_t in;
+
+	ahead_pause(false);
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	ext_port_bytes(3);
+
+	start = now_ns;
+	in = avr_wait(ready, timeout_ms);
+	if (notify) {
+		notify_count++;
+		notify_sleep(start, timeout_ms);
+	}
+
+	ext_port_bytes(1);
+	return in;
+}
+
+uint8_t spi_wait_token(unsigned int timeout_ms)
+{
+	return ext_wait(false, timeout_ms);
+}
+
+bool spi_wait_ready(unsigned int timeout_ms)
+{
+	return ext_wait(true, timeout_ms) == 0xff;
+}
+
+/* An SD command sent by the AVR, as sd_command() in avr/main.c */
+static uint8_t avr_command(uint8_t cmd, uint32_t arg)
+{
+	unsigned int polls = 10;
+	uint8_t r1;
+
+	avr_exchange(0xff);
+	avr_exchange(0x40 | cmd);
+	avr_exchange(arg >> 24);
+	avr_exchange(arg >> 16);
+	avr_exchange(arg >> 8);
+	avr_exchange(arg);
+	avr_exchange(0x01);
+	if (cmd == 12) {
+		avr_exchange(0xff);
+	}
+	do {
+		r1 = avr_exchange(0xff);
+	} while ((r1 & 0x80) && --polls);
+
+	return r1;
+}
+
+/* READ_SECTORS/WRITE_SECTORS, following ext_sectors() in avr/main.c */
+#define SECTORS_TIMEOUT_MS	500
+#define SECTORS_TOKEN		((sectors.flags & SPI_SECTORS_MULTI) ? 0xfc : 0xfe)
+
+static struct {
+	bool		write;
+	bool		buffered;
+	bool		ahead;		/* reads may go on beyond count (PREFETCH) */
+	bool		notify;		/* ACK pulse with every status, writes (NOTIFY) */
+	uint8_t		flags;
+	uint16_t	left;
+	uint8_t		status;		/* error or final status once done */
+	bool		done;
+	uint8_t		buf[2][SPI_SECTOR_SIZE];
+	unsigned int	cur;
+	bool		job;		/* buffered write of buf[cur ^ 1] not yet finished */
+} sectors;
+
+/* Sectors read ahead into the AVR SRAM, by buffered reads and PREFETCH */
+#define AHEAD_SECTORS		2
+
+static struct {
+	uint8_t		buf[AHEAD_SECTORS][SPI_SECTOR_SIZE];
+	uint64_t	ready_ns[AHEAD_SECTORS];	/* when the AVR had it */
+	unsigned int	head;
+	unsigned int	ready;
+	unsigned int	prefetched;	/* ready before the current command */
+	uint8_t		error;		/* status of a failed read ahead */
+	uint64_t	busy_ns;	/* PREFETCH reading with BUSY high until then */
+	bool		enabled;
+	uint16_t	hits;
+	uint16_t	misses;
+} ahead;
+
+/* Card side of a sector, as card_step() in avr/main.c. Returns 0xfe/0 or the error. */
+static uint8_t card_read_sector(uint8_t *buf)
+{
+	unsigned int n;
+	uint8_t in;
+
+	in = avr_wait(false, SECTORS_TIMEOUT_MS);
+	if (in != 0xfe) {
+		return in;
+	}
+	for (n = 0; n < SPI_SECTOR_SIZE; n++) {
+		*buf++ = avr_exchange(0xff);
+	}
+	avr_exchange(0xff);
+	avr_exchange(0xff);
+	return 0xfe;
+}
+
+static uint8_t card_write_sector(const uint8_t *buf, uint8_t token)
+{
+	unsigned int n;
+	uint8_t resp;
+
+	if (avr_wait(true, SECTORS_TIMEOUT_MS) != 0xff) {
+		return 0xff;
+	}
+	avr_exchange(token);
+	for (n = 0; n < SPI_SECTOR_SIZE; n++) {
+		avr_exchange(*buf++);
+	}
+	avr_exchange(0xff);
+	avr_exchange(0xff);
+	resp = avr_exchange(0xff);
+	return ((resp & 0x1f) == 0x05) ? 0 : resp;
+}
+
+/* Runs the card side during the transfer of a sector over the port */
+static void port_sector_begin(void)
+{
+	lockstep = SPI_SECTOR_SIZE;
+}
+
+static void port_sector_end(void)
+{
+	now_ns += lockstep * port_timing.byte_ns;
+	lockstep = 0;
+	port_stats.bytes += SPI_SECTOR_SIZE;
+}
+
+static void ahead_fill(void)
+{
+	unsigned int i = (ahead.head + ahead.ready) % AHEAD_SECTORS;
+	uint8_t status;
+
+	status = card_read_sector(ahead.buf[i]);
+	if (status != 0xfe) {
+		ahead.error = status;
+		return;
+	}
+	ahead.ready_ns[i] = now_ns;
+	ahead.ready++;
+}
+
+static void ahead_pop(uint8_t *buf)
+{
+	if (now_ns < ahead.ready_ns[ahead.head]) {
+		now_ns = ahead.ready_ns[ahead.head];
+	}
+	memcpy(buf, ahead.buf[ahead.head], SPI_SECTOR_SIZE);
+	ahead.head = (ahead.head + 1) % AHEAD_SECTORS;
+	ahead.ready--;
+	if (ahead.prefetched) {
+		ahead.prefetched--;
+		ahead.hits++;
+	}
+}
+
+static void ahead_drop(void)
+{
+	ahead.misses += ahead.ready;
+	ahead.ready = 0;
+	ahead.prefetched = 0;
+	ahead.error = 0;
+}
+
+/* The POUT toggles of the next command's wait for BUSY pause the read ahead, only READ_SECTORS
+ * without OPEN keeps it */
+static void ahead_pause(bool keep)
+{
+	if (now_ns < ahead.busy_ns) {
+		now_ns += port_timing.byte_ns;
+	}
+	ahead.busy_ns = 0;
+	if (!keep) {
+		ahead_drop();
+	}
+}
+
+/* A POUT toggle of wait_until_idle() that arrives after BUSY dropped. The AVR reads the undriven
+ * bus as the command byte 0xff, keeps the read ahead and stays with BUSY low, so the edge of the
+ * command the Amiga sends next is taken as that command and not as a wake edge. */
+void sim_stray_toggle(void)
+{
+	ahead_pause(true);
+	now_ns += port_timing.byte_ns;
+}
+
+static void sectors_fail(uint8_t status)
+{
+	sectors.done = true;
+	sectors.status = status;
+}
+
+void spi_sectors_begin(bool write, uint32_t addr, uint16_t count, uint8_t flags)
+{
+	uint8_t status = 0;
+
+	ahead_pause(!write && !(flags & SPI_SECTORS_OPEN));
+	ahead.prefetched = ahead.ready;
+
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	ext_port_bytes(8);
+
+	if (flags & SPI_SECTORS_OPEN) {
+		if (write && (flags & SPI_SECTORS_PREERASE)) {
+			if (avr_command(55, 0) <= 1) {
+				avr_command(23, count);
+			}
+		}
+		if (write) {
+			status = avr_command((flags & SPI_SECTORS_MULTI) ? 25 : 24, addr);
+		} else {
+			status = avr_command((flags & SPI_SECTORS_MULTI) ? 18 : 17, addr);
+		}
+	}
+
+	sectors.write = write;
+	sectors.notify = write && notify_on();
+	sectors.ahead = !write && ahead.enabled && (flags & SPI_SECTORS_MULTI) && !(flags & SPI_SECTORS_CLOSE);
+	if (write) {
+		sectors.buffered = (flags & SPI_SECTORS_BUFFERED) && count > 1;
+	} else {
+		sectors.buffered = sectors.ahead || ahead.ready || ahead.error || ((flags & SPI_SECTORS_BUFFERED) && count > 1);
+	}
+	sectors.flags = flags;
+	sectors.left = count;
+	sectors.status = status;
+	sectors.done = status != 0;
+	sectors.cur = 0;
+	sectors.job = false;
+
+	/* The first sector of a buffered read is in SRAM before its frame */
+	if (!sectors.done && sectors.buffered && !write && !ahead.ready && !ahead.error) {
+		ahead_fill();
+	}
+}
+
+static uint8_t sectors_status(void)
+{
+	uint8_t in;
+
+	if (sectors.done) {
+		return sectors.status;
+	}
+
+	if (sectors.left) {
+		if (sectors.write) {
+			if (sectors.buffered) {
+				return 0;
+			}
+			if (avr_wait(true, SECTORS_TIMEOUT_MS) != 0xff) {
+				sectors_fail(0xff);
+				return 0xff;
+			}
+			avr_exchange(SECTORS_TOKEN);
+			return 0;
+		}
+		if (sectors.buffered) {
+			if (ahead.ready) {
+				return 0xfe;
+			}
+			sectors_fail(ahead.error);
+			return ahead.error;
+		}
+		in = avr_wait(false, SECTORS_TIMEOUT_MS);
+		if (in != 0xfe) {
+			sectors_fail(in);
+		}
+		return in;
+	}
+
+	sectors.done = true;
+	if (sectors.job) {
+		sectors.status = card_write_sector(sectors.buf[sectors.cur ^ 1], SECTORS_TOKEN);
+		sectors.job = false;
+		if (sectors.status) {
+			return sectors.status;
+		}
+	}
+	if ((sectors.flags & SPI_SECTORS_MULTI) && (sectors.flags & SPI_SECTORS_CLOSE)) {
+		if (sectors.write) {
+			if (avr_wait(true, SECTORS_TIMEOUT_MS) == 0xff) {
+				avr_exchange(0xfd);
+			} else {
+				sectors.status = 0xff;
+			}
+		} else {
+			sectors.status = avr_command(12, 0);
+		}
+	}
+	return sectors.status;
+}
+
+uint8_t spi_sectors_status(void)
+{
+	uint64_t start;
+	uint8_t status;
+
+	ext_port_bytes(1);
+
+	if (!sectors.notify) {
+		return sectors_status();
+	}
+	notify_count++;
+	start = now_ns;
+	status = sectors_status();
+	notify_sleep(start, SECTORS_TIMEOUT_MS);
+	return status;
+}
+
+void spi_sectors_read(uint8_t *buf)
+{
+	unsigned int n;
+
+	if (sectors.buffered) {
+		ahead_pop(buf);
+		port_sector_begin();
+		/* The next sector is read while this one crosses the port */
+		if (!ahead.error && (sectors.ahead || sectors.left > ahead.ready + 1)) {
+			ahead_fill();
+		}
+		port_sector_end();
+		sectors.left--;
+		return;
+	}
+
+	for (n = 0; n < SPI_SECTOR_SIZE; n++) {
+		*buf++ = exchange(0xff);
+	}
+	avr_exchange(0xff);
+	avr_exchange(0xff);
+	sectors.left--;
+}
+
+void spi_sectors_write(const uint8_t *buf)
+{
+	unsigned int n;
+	uint8_t resp;
+
+	if (sectors.buffered) {
+		memcpy(sectors.buf[sectors.cur], buf, SPI_SECTOR_SIZE);
+		port_sector_begin();
+		if (sectors.job) {
+			/* The previous sector is written while this one crosses the port */
+			resp = card_write_sector(sectors.buf[sectors.cur ^ 1], SECTORS_TOKEN);
+			if (resp) {
+				sectors_fail(resp);
+			}
+		}
+		port_sector_end();
+		sectors.job = !sectors.done;
+		sectors.cur ^= 1;
+		sectors.left--;
+		return;
+	}
+
+	for (n = 0; n < SPI_SECTOR_SIZE; n++) {
+		exchange(*buf++);
+	}
+	avr_exchange(0xff);
+	avr_exchange(0xff);
+	resp = avr_exchange(0xff);
+	if ((resp & 0x1f) != 0x05) {
+		sectors_fail(resp);
+	}
+	sectors.left--;
+}
+
+void spi_sectors_end(void)
+{
+	uint64_t idle = now_ns;
+
+	if (sectors.write || !sectors.buffered) {
+		return;
+	}
+	if (sectors.status || !sectors.ahead) {
+		ahead_drop();
+		return;
+	}
+
+	/* PREFETCH fills the buffers while the Amiga goes on */
+	while (ahead.ready < AHEAD_SECTORS && !ahead.error) {
+		ahead_fill();
+	}
+	ahead.busy_ns = now_ns;
+	now_ns = idle;
+}
+
+/* PREFETCH */
+bool spi_prefetch(uint8_t mode, uint16_t *hits, uint16_t *misses)
+{
+	ahead_pause(false);
+
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	ext_port_bytes(2 + 4);
+
+	if (mode != SPI_PREFETCH_KEEP) {
+		ahead.enabled = mode == SPI_PREFETCH_ON && (caps & SPI_CAP_PREFETCH);
+	}
+	*hits = ahead.hits;
+	*misses = ahead.misses;
+	ahead.hits = 0;
+	ahead.misses = 0;
+	return true;
+}
+
+/* QUERY, sim_set_caps(0) stands for firmware without it */
+uint8_t spi_probe(void)
+{
+	ahead_pause(false);
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	ext_port_bytes(2 + 3);
+
+	caps = firmware_caps;
+	return caps;
+}
+
+uint8_t spi_get_caps(void)
+{
+	return caps;
+}
+
+bool spi_check_fault(void)
+{
+	return false;
+}
+
+uint8_t spi_get_version(void)
+{
+	return caps ? 2 : 0;
+}
+
+void spi_set_sleep(spi_sleep_t sleep)
+{
+	sleep_fn = sleep;
+}
+
+/* Every pulse arrives in the simulation, there are no FLAG interrupts to count */
+void spi_set_flag_count(volatile uint32_t *count)
+{
+	(void)count;
+}
+
+uint32_t spi_get_notify_count(void)
+{
+	return notify_count;
+}
+
+void spi_set_max_transfer(unsigned int bytes)
+{
+	max_transfer = bytes;
+}
+
+uint32_t spi_get_max_disabled_us(void)
+{
+	return (uint32_t)(max_disabled_ns / 1000);
+}
+
+void spi_reset_max_disabled(void)
+{
+	max_disabled_ns = 0;
+}
+
+/* Splits a fast transfer like spi-par.c, each chunk is one transaction with interrupts disabled */
+static unsigned int next_chunk(unsigned int size)
+{
+	unsigned int chunk = size;
+
+	if (current_speed == spiSpeed_Fast && max_transfer && size > max_transfer) {
+		chunk = max_transfer;
+	}
+	ahead_pause(false);
+	now_ns += port_timing.xfer_ns;
+	port_stats.transactions++;
+	return chunk;
+}
+
+static void end_chunk(uint64_t start)
+{
+	if (current_speed == spiSpeed_Fast && now_ns - start > max_disabled_ns) {
+		max_disabled_ns = now_ns - start;
+	}
+}
+
+void spi_read(uint8_t *buf, unsigned int size)
+{
+	unsigned int chunk;
+	uint64_t start;
+
+	while (size) {
+		start = now_ns;
+		chunk = next_chunk(size);
+		size -= chunk;
+		while (chunk--) {
+			*buf++ = exchange(0xff);
+		}
+		end_chunk(start);
+	}
+}
+
+void spi_write(const uint8_t *buf, unsigned int size)
+{
+	unsigned int chunk;
+	uint64_t start;
+
+	while (size) {
+		start = now_ns;
+		chunk = next_chunk(size);
+		size -= chunk;
+		while (chunk--) {
+			exchange(*buf++);
+		}
+		end_chunk(start);
+	}
+}
@@ -0,0 +1,42 @@
+/*
+ * Host implementation of timer.h following the modelled clock of spi-sim.c
+ */
+
+#include "common.h"
+#include "timer.h"
+#include "sim.h"
+
+#define NS_PER_TICK		(1000000000ull / (TIMER_TICK_FREQ))
+
+uint32_t timer_get_tick_count(void)
+{
+	sim_charge_tick_read();
+	return (uint32_t)(sim_get_time_ns() / NS_PER_TICK);
+}
+
+/* The beam counter of a 50 Hz frame, following the modelled clock */
+uint32_t timer_get_beam(void)
+{
+	return (uint32_t)((sim_get_time_ns() % NS_PER_TICK) / TIMER_CC_NS);
+}
+
+uint32_t timer_get_frame_cc(void)
+{
+	return (uint32_t)(NS_PER_TICK / TIMER_CC_NS);
+}
+
+/* Microseconds of modelled time, as fine as the E-clock */
+void timer_set_device(struct Device *device)
+{
+	(void)device;
+}
+
+uint32_t timer_get_stamp(void)
+{
+	return (uint32_t)(sim_get_time_ns() / 1000);
+}
+
+uint32_t timer_get_stamp_freq(void)
+{
+	return 1000000;
+}
@@ -0,0 +1,81 @@
+/*
+ * Time spent per phase of card access, shared by the Amiga and host builds
+ */
+
+#include "common.h"
+#include "timer.h"
+#include "prof.h"
+
+static spisd_profile_t prof;
+static unsigned int cur = PROF_NONE;
+static uint32_t cur_start;
+static bool running;
+
+/*! Charges the time since the last switch to the current phase */
+static void prof_switch(unsigned int phase)
+{
+	uint32_t now;
+
+	if (running) {
+		now = timer_get_stamp();
+		if (cur != PROF_NONE) {
+			prof.time[cur] += now - cur_start;
+		}
+		cur_start = now;
+	}
+	cur = phase;
+}
+
+void prof_start(void)
+{
+	prof_clear();
+	cur_start = timer_get_stamp();
+	running = true;
+}
+
+void prof_stop(void)
+{
+	prof_switch(cur);
+	running = false;
+}
+
+unsigned int prof_enter(unsigned int phase)
+{
+	unsigned int prev = cur;
+
+	if (phase != prev) {
+		prof_switch(phase);
+		prof.count[phase]++;
+	}
+	return prev;
+}
+
+void prof_leave(unsigned int phase)
+{
+	if (phase != cur) {
+		prof_switch(phase);
+	}
+}
+
+void prof_get(spisd_profile_t *profile)
+{
+	unsigned int i;
+
+	/* Charges the phase in progress, the caller may be inside one */
+	prof_switch(cur);
+	profile->freq = timer_get_stamp_freq();
+	for (i = 0; i < SPISD_PHASES; i++) {
+		profile->count[i] = prof.count[i];
+		profile->time[i] = prof.time[i];
+	}
+}
+
+void prof_clear(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SPISD_PHASES; i++) {
+		prof.count[i] = 0;
+		prof.time[i] = 0;
+	}
+}
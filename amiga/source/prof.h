@@ -0,0 +1,35 @@
+/*
+ * Time spent per phase of card access, see SPISD_CMD_GETPROFILE
+ */
+
+#ifndef PROF_H_
+#define PROF_H_
+
+#include "spisd.h"
+
+/*! Phase outside of the SPISD_PHASE_* ones, not timed */
+#define PROF_NONE				SPISD_PHASES
+
+/*!
+ * Starts timing with timer_get_stamp(), clearing the profile. Until then,
+ * and after prof_stop(), phases are tracked but not timed.
+ */
+void prof_start(void);
+void prof_stop(void);
+
+/*!
+ * Enters one of the SPISD_PHASE_* phases. Time is charged to the phase
+ * entered last, so a phase inside another one is not counted twice.
+ * Entering the current phase again changes nothing.
+ *
+ * \return				The phase left, for prof_leave()
+ */
+unsigned int prof_enter(unsigned int phase);
+
+/*! Returns to the phase that prof_enter() left */
+void prof_leave(unsigned int phase);
+
+void prof_get(spisd_profile_t *profile);
+void prof_clear(void);
+
+#endif /* PROF_H_ */
@@ -22,6 +22,8 @@
 
 #include "common.h"
 #include "timer.h"
+#include "prof.h"
+#include "trace.h"
 
 #include "sd.h"
 #include "spi-par.h"
@@ -33,6 +35,15 @@
 #define INIT_TIMEOUT_MS		1000
 #define MAX_RESPONSE_POLLS	10
 
+/* Bytes clocked in per transfer while polling. R1 normally follows the
+ * command after a single NCR byte. Bytes read past a data token are block
+ * data and not wasted, so token polls use long transfers. Bytes read past
+ * the end of busy are wasted, so ready polls stay short. */
+#define POLL_BATCH_R1		2
+#define POLL_BATCH_TOKEN	16
+#define POLL_BATCH_READY	2
+#define POLL_BATCH_MAX		POLL_BATCH_TOKEN
+
 /* MMC/SD command */
 #define CMD0	(0)			/* GO_IDLE_STATE */
 #define CMD1	(1)			/* SEND_OP_COND (MMC) */
@@ -57,6 +68,24 @@
 
 static sd_card_info_t sd_card_info;
 
+typedef enum {
+	sdStream_None = 0,
+	sdStream_Read,
+	sdStream_Write,
+} sd_stream_t;
+
+/* Multiple-block transfer left open between requests */
+static sd_stream_t stream;
+static uint32_t stream_next;		/* next sector of the open transfer */
+static uint32_t stream_tick;		/* time of the last request served from it */
+static uint32_t read_next;			/* sector following the last read, for sequential detection */
+static uint32_t write_next;			/* sector following the last write, for sequential detection */
+
+/* Read ahead on the adapter, see spi_prefetch() */
+static bool prefetch_on = true;
+static uint32_t prefetch_hits;
+static uint32_t prefetch_misses;
+
 /*! Utility function for parsing CSD fields */
 static int sd_parse_csd(sd_card_info_t *ci, const uint32_t *bits)
 {
@@ -171,31 +200,158 @@ static int sd_parse_cid(sd_card_info_t *ci, const uint32_t *bits)
 }
 
 
+/*
+ * All bytes from the card go through sd_rx(). Polls clock in several bytes
+ * per parallel port transfer, so the byte they are looking for may be
+ * followed by bytes that belong to whatever comes next (R7/OCR payload,
+ * data token, block data). Those are kept in rx_ahead and handed out first
+ * by the next sd_rx() or sd_poll(). Sending anything to the card, or
+ * deselecting it, discards them.
+ */
+static uint8_t rx_ahead[POLL_BATCH_MAX];
+static unsigned int rx_ahead_pos;
+static unsigned int rx_ahead_len;
+
+static void sd_rx(uint8_t *buf, unsigned int size)
+{
+	while (size && rx_ahead_pos < rx_ahead_len) {
+		*buf++ = rx_ahead[rx_ahead_pos++];
+		size--;
+	}
+	if (size) {
+		spi_read(buf, size);
+	}
+}
+
+static void sd_tx(const uint8_t *buf, unsigned int size)
+{
+	rx_ahead_pos = rx_ahead_len = 0;
+	spi_write(buf, size);
+}
+
+/*!
+ * Clocks in bytes, 'batch' per transfer, until one satisfies
+ * ((byte & mask) == value) == equal. Gives up after max_polls bytes
+ * (0 = no limit) or after 'ticks' timer ticks (0 = no limit). The last byte
+ * seen is returned in *res either way. Waits with a tick limit are long
+ * ones and sleep between the transfers once they outlast the spin window.
+ */
+static int sd_poll(uint8_t *res, uint8_t mask, uint8_t value, bool equal,
+		unsigned int batch, unsigned int max_polls, uint32_t ticks)
+{
+	timer_wait_t w;
+	uint32_t timeout = 0;
+	unsigned int polls = 0;
+	uint8_t in = 0xff;
+
+	if (ticks) {
+		timer_wait_begin(&w);
+		timeout = w.start + ticks;
+	}
+
+	for (;;) {
+		if (rx_ahead_pos == rx_ahead_len) {
+			if (max_polls && batch > max_polls - polls) {
+				batch = max_polls - polls;
+			}
+			spi_read(rx_ahead, batch);
+			rx_ahead_pos = 0;
+			rx_ahead_len = batch;
+		}
+
+		while (rx_ahead_pos < rx_ahead_len) {
+			in = rx_ahead[rx_ahead_pos++];
+			polls++;
+			if (((in & mask) == value) == equal) {
+				*res = in;
+				return 0;
+			}
+			if (max_polls && polls == max_polls) {
+				*res = in;
+				return sdError_Timeout;
+			}
+		}
+
+		if (ticks && (int32_t)(timer_wait_poll(&w) - timeout) >= 0) {
+			*res = in;
+			return sdError_Timeout;
+		}
+	}
+}
+
+/*!
+ * Waits for the card to be ready (0xff) or for a data token (anything but
+ * 0xff). Bytes already read ahead are looked at first, the rest of the wait
+ * runs on the adapter if it can do that.
+ */
+static int sd_wait_byte(uint8_t *res, bool ready, unsigned int batch)
+{
+	unsigned int phase;
+	int err;
+
+	while (rx_ahead_pos < rx_ahead_len) {
+		*res = rx_ahead[rx_ahead_pos++];
+		if ((*res == 0xff) == ready) {
+			return 0;
+		}
+	}
+
+	phase = prof_enter(ready ? SPISD_PHASE_BUSY : SPISD_PHASE_TOKEN);
+	if (spi_get_caps() & SPI_CAP_WAIT) {
+		if (ready) {
+			*res = spi_wait_ready(READY_TIMEOUT_MS) ? 0xff : 0;
+		} else {
+			*res = spi_wait_token(READY_TIMEOUT_MS);
+		}
+		err = ((*res == 0xff) == ready) ? 0 : sdError_Timeout;
+	} else {
+		err = sd_poll(res, 0xff, 0xff, ready, batch, 0, TIMER_MILLIS(READY_TIMEOUT_MS));
+	}
+	prof_leave(phase);
+
+	return err;
+}
+
 static int sd_wait_ready(void)
 {
-	uint32_t timeout;
 	uint8_t in;
 
-	timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
-	do {
-		spi_read(&in, 1);
-	} while (in != 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
-
-	return (in == 0xff) ? 0 : sdError_Timeout;
+	return sd_wait_byte(&in, true, POLL_BATCH_READY);
 }
 
+/*
+ * Command sequencing. The card stays selected from the first command of an
+ * operation until sd_deselect() at its end, so related commands (CMD55 and
+ * its ACMD, ACMD23 and CMD25, the ACMD41 init loop) go out back to back.
+ * sd_ready records that the card is known not to be busy: it is set by a
+ * successful ready poll or by an R1 response to a command without busy
+ * signalling, and cleared once a block has been written or a command with
+ * busy (CMD12) issued. While it is set the ready poll before the next
+ * command is skipped. CMD24/CMD25 leave it clear: the ready poll before the
+ * first data token then clocks the 0xff byte (N_WR) the card needs between
+ * the response and the token.
+ */
+static bool sd_selected;
+static bool sd_ready;
+
 static void sd_deselect(void)
 {
+	rx_ahead_pos = rx_ahead_len = 0;
 	spi_deselect();
+	sd_selected = false;
 }
 
 static int sd_select(void)
 {
-	spi_select();
-	if (sd_wait_ready() == 0) {
+	if (!sd_selected) {
+		spi_select();
+		sd_selected = true;
+	}
+	if (sd_ready || sd_wait_ready() == 0) {
+		sd_ready = true;
 		return 0;
 	}
-	spi_deselect();
+	sd_deselect();
 
 	ERROR("Timeout waiting for card ready\n");
 	return sdError_Timeout;
@@ -203,22 +359,21 @@ static int sd_select(void)
 
 static int sd_read_block(uint8_t *buf, unsigned int size)
 {
-	uint32_t timeout;
 	uint8_t token, crc[2];
+	unsigned int phase;
 
 	/* Wait for data start token */
-	timeout = timer_get_tick_count() + TIMER_MILLIS(READY_TIMEOUT_MS);
-	do {
-		spi_read(&token, 1);
-	} while (token == 0xff && (int32_t)(timer_get_tick_count() - timeout) < 0);
+	sd_wait_byte(&token, false, POLL_BATCH_TOKEN);
 	if (token != 0xfe) {
 		ERROR("No data token received\n");
 		return sdError_Timeout;
 	}
 
 	/* Read data */
-	spi_read(buf, size);
-	spi_read(crc, 2);
+	phase = prof_enter(SPISD_PHASE_DATA);
+	sd_rx(buf, size);
+	sd_rx(crc, 2);
+	prof_leave(phase);
 
 	return 0;
 }
@@ -227,21 +382,25 @@ static int sd_write_block(const uint8_t *buf, uint8_t token)
 {
 	uint8_t crc[2] = {0xff, 0xff};
 	uint8_t resp;
+	unsigned int phase;
 
-	if (sd_wait_ready() < 0) {
+	if (!sd_ready && sd_wait_ready() < 0) {
 		ERROR("Card not ready\n");
 		return sdError_Timeout;
 	}
 
-	/* Send token */
-	spi_write(&token, 1);
+	/* Send token, the card is busy after data or STOP_TRAN */
+	sd_ready = false;
+	sd_tx(&token, 1);
 	if (token != 0xfd) {
 		/* Send data, except for STOP_TRAN */
-		spi_write(buf, SD_SECTOR_SIZE);
-		spi_write(crc, 2); /* dummy */
+		phase = prof_enter(SPISD_PHASE_DATA);
+		sd_tx(buf, SD_SECTOR_SIZE);
+		sd_tx(crc, 2); /* dummy */
 
 		/* Receive data response */
-		spi_read(&resp, 1);
+		sd_rx(&resp, 1);
+		prof_leave(phase);
 		if ((resp & 0x1f) != 0x05) {
 			ERROR("Bad response\n");
 			return sdError_BadResponse;
@@ -251,11 +410,12 @@ static int sd_write_block(const uint8_t *buf, uint8_t token)
 	return 0;
 }
 
-static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
+static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg);
+
+static uint8_t sd_do_cmd(uint8_t cmd, uint32_t arg)
 {
 	uint8_t res;
-	uint8_t buf[6];
-	int n;
+	uint8_t buf[SPI_COMMAND_FRAME];
 
 	if (cmd & 0x80) {
 		/* Send CMD55 prior to ACMD */
@@ -268,54 +428,128 @@ static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
 
 	/* Select the card and wait for ready except for abort */
 	if (cmd != CMD12) {
-		sd_deselect();
 		if (sd_select() < 0) {
 			return 0xff;
 		}
 	}
 
-	/* Build command */
-	buf[0] = 0x40 | cmd;
-	buf[1] = (uint8_t)(arg >> 24);
-	buf[2] = (uint8_t)(arg >> 16);
-	buf[3] = (uint8_t)(arg >> 8);
-	buf[4] = (uint8_t)(arg >> 0);
+	/* Build command, preceded by one byte of clocks for NCS/NRC */
+	buf[0] = 0xff;
+	buf[1] = 0x40 | cmd;
+	buf[2] = (uint8_t)(arg >> 24);
+	buf[3] = (uint8_t)(arg >> 16);
+	buf[4] = (uint8_t)(arg >> 8);
+	buf[5] = (uint8_t)(arg >> 0);
 	if (cmd == CMD0) {
-		buf[5] = 0x95; /* CRC for CMD0 */
+		buf[6] = 0x95; /* CRC for CMD0 */
 	} else if (cmd == CMD8) {
-		buf[5] = 0x87; /* CRC for CMD8 */
+		buf[6] = 0x87; /* CRC for CMD8 */
 	} else {
-		buf[5] = 0x01; /* Dummy CRC and stop */
-	}
-	spi_write(buf, sizeof(buf));
-
-	/* Receive command response */
-	if (cmd == CMD12) {
-		/* Skip first byte */
-		spi_read(&res, 1);
+		buf[6] = 0x01; /* Dummy CRC and stop */
 	}
+	if (spi_get_caps() & SPI_CAP_COMMAND) {
+		/* One adapter transaction, the R3/R7 payload is kept for sd_rx() */
+		rx_ahead_len = (cmd == CMD8 || cmd == CMD58) ? 5 : 1;
+		spi_command(buf, cmd == CMD12, MAX_RESPONSE_POLLS, rx_ahead, rx_ahead_len - 1);
+		rx_ahead_pos = 1;
+		res = rx_ahead[0];
+	} else {
+		sd_tx(buf, sizeof(buf));
 
-	for (n = 0; n < MAX_RESPONSE_POLLS; n++) {
-		spi_read(&res, 1);
-		if (!(res & 0x80)) {
-			break;
+		/* Receive command response */
+		if (cmd == CMD12) {
+			/* Skip first byte */
+			sd_rx(&res, 1);
 		}
+
+		sd_poll(&res, 0x80, 0x80, false, POLL_BATCH_R1, MAX_RESPONSE_POLLS, 0);
 	}
 
+	/* Card can take the next command straight away unless it signals busy,
+	 * write data waits for at least one byte after R1 */
+	sd_ready = !(res & 0x80) && cmd != CMD12 && cmd != CMD24 && cmd != CMD25;
+
+	return res;
+}
+
+/*! Sends a command and returns R1, timed as the STOP phase for CMD12 */
+static uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg)
+{
+	unsigned int phase = prof_enter(cmd == CMD12 ? SPISD_PHASE_STOP : SPISD_PHASE_COMMAND);
+	uint8_t res;
+
+	res = sd_do_cmd(cmd, arg);
+	prof_leave(phase);
+	TRACE_EVENT(SPISD_EVENT_COMMAND, cmd, arg, 0, res);
+
 	return res;
 }
 
+static uint32_t sd_get_be32(const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3] << 0);
+}
+
 static uint32_t sd_get_r7_resp(void)
 {
 	uint8_t buf[4];
 
-	spi_read(buf, 4);
-	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3] << 0);
+	sd_rx(buf, 4);
+	return sd_get_be32(buf);
+}
+
+/*! Reads a 128-bit CSD/CID register into four words, most significant first */
+static int sd_read_reg(uint32_t *bits)
+{
+	uint8_t raw[16];
+	int err, n;
+
+	err = sd_read_block(raw, sizeof(raw));
+	if (err == 0) {
+		for (n = 0; n < 4; n++) {
+			bits[n] = sd_get_be32(&raw[n * 4]);
+		}
+	}
+	return err;
+}
+
+/*!
+ * Sends a PREFETCH mode to the adapter and adds up its counters. Read ahead
+ * needs the transfer to be stopped with spi_command(), and the PREFETCH
+ * command drops what was read ahead, so an open transfer is stopped first.
+ */
+static void sd_prefetch(uint8_t mode)
+{
+	uint8_t caps = spi_get_caps();
+	uint16_t hits, misses;
+
+	if (!(caps & SPI_CAP_PREFETCH) || !(caps & SPI_CAP_COMMAND)) {
+		return;
+	}
+	sd_flush();
+	if (spi_prefetch(mode, &hits, &misses)) {
+		prefetch_hits += hits;
+		prefetch_misses += misses;
+	}
+}
+
+void sd_set_prefetch(bool enable)
+{
+	prefetch_on = enable;
+	sd_prefetch(enable ? SPI_PREFETCH_ON : SPI_PREFETCH_OFF);
+}
+
+void sd_get_prefetch_stats(uint32_t *hits, uint32_t *misses)
+{
+	sd_prefetch(SPI_PREFETCH_KEEP);
+	*hits = prefetch_hits;
+	*misses = prefetch_misses;
 }
 
 int sd_open(void)
 {
 	sd_card_info_t *ci = &sd_card_info;
+	timer_wait_t w;
 	uint32_t timeout;
 	uint8_t cmd;
 	uint32_t resp[4];
@@ -323,7 +557,15 @@ int sd_open(void)
 
 	FUNCTION_TRACE;
 
+	/* The adapter may have been swapped or reflashed while closed */
+	spi_probe();
+	INFO("Adapter firmware version %u capabilities %02X\n", spi_get_version(), spi_get_caps());
+
 	spi_set_speed(spiSpeed_Slow);
+	stream = sdStream_None;
+	sd_ready = false;
+	read_next = 0;
+	write_next = 0;
 	ci->type = sdCardType_None;
 	ci->capacity = 0;
 	ci->block_size = sdBlockSize_512;
@@ -342,13 +584,15 @@ int sd_open(void)
 				TRACE("SDv2 - R7 resp = 0x%08X\n", (unsigned int) ocr);
 				ci->type = sdCardType_SD2_0;
 
-				/* Wait for card ready */
-				timeout = timer_get_tick_count() + TIMER_MILLIS(INIT_TIMEOUT_MS);
+				/* Wait for card ready, sleeping between the polls */
+				timer_wait_begin(&w);
+				timeout = w.start + TIMER_MILLIS(INIT_TIMEOUT_MS);
 				while (sd_send_cmd(ACMD41, (1ul << 30)) > 0) {
-					if ((int32_t)(timer_get_tick_count() - timeout) >= 0) {
+					if ((int32_t)(timer_wait_poll(&w) - timeout) >= 0) {
 						/* Init timed out - invalidate card */
 						ERROR("Init timed out\n");
 						ci->type = sdCardType_None;
+						break;
 					}
 				}
 
@@ -379,13 +623,15 @@ int sd_open(void)
 				cmd = CMD1;
 			}
 
-			/* Wait for card ready */
-			timeout = timer_get_tick_count() + TIMER_MILLIS(INIT_TIMEOUT_MS);
+			/* Wait for card ready, sleeping between the polls */
+			timer_wait_begin(&w);
+			timeout = w.start + TIMER_MILLIS(INIT_TIMEOUT_MS);
 			while (sd_send_cmd(cmd, 0) > 0) {
-				if ((int32_t)(timer_get_tick_count() - timeout) >= 0) {
+				if ((int32_t)(timer_wait_poll(&w) - timeout) >= 0) {
 					/* Init timed out - invalidate card */
 					ERROR("Init timed out\n");
 					ci->type = sdCardType_None;
+					break;
 				}
 			}
 
@@ -404,7 +650,7 @@ int sd_open(void)
 
 		/* Read and decode card info */
 		if (sd_send_cmd(CMD10, 0) == 0) {
-			err = sd_read_block((uint8_t*)&resp, sizeof(resp));
+			err = sd_read_reg(resp);
 			if (err < 0) {
 				ERROR("Read CID failed\n");
 			}
@@ -416,7 +662,7 @@ int sd_open(void)
 		}
 		if (err == 0) {
 			if (sd_send_cmd(CMD9, 0) == 0) {
-				err = sd_read_block((uint8_t*)&resp, sizeof(resp));
+				err = sd_read_reg(resp);
 				if (err < 0) {
 					ERROR("Read CSD failed\n");
 				}
@@ -430,6 +676,7 @@ int sd_open(void)
 
 		/* Switch to fast clock */
 		spi_set_speed(spiSpeed_Fast);
+		sd_prefetch(prefetch_on ? SPI_PREFETCH_ON : SPI_PREFETCH_OFF);
 	} else {
 		/* Card not present */
 		err = sdError_NoCard;
@@ -440,104 +687,364 @@ int sd_open(void)
 	return err;
 }
 
-int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
+/*! Converts a sector number to the command argument for the card type */
+static uint32_t sd_addr(uint32_t sector)
+{
+	if (sd_card_info.type != sdCardType_SDHC) {
+		/* Convert sector to byte addressing (x512) */
+		return sector << SD_SECTOR_SHIFT;
+	}
+	return sector;
+}
+
+static bool sd_stream_expired(void)
+{
+	return (int32_t)(timer_get_tick_count() - stream_tick) >= (int32_t)TIMER_MILLIS(SD_STREAM_IDLE_MS);
+}
+
+int sd_flush(void)
+{
+	unsigned int phase;
+	int err = 0;
+
+	if (stream == sdStream_Read) {
+		/* Send CMD12 stop transmission */
+		if (sd_send_cmd(CMD12, 0) != 0) {
+			err = sdError_BadResponse;
+		}
+		sd_deselect();
+	} else if (stream == sdStream_Write) {
+		/* Send STOP_TRAN */
+		phase = prof_enter(SPISD_PHASE_STOP);
+		err = sd_write_block(0, 0xfd);
+		prof_leave(phase);
+		sd_deselect();
+	}
+	if (stream != sdStream_None) {
+		TRACE_EVENT(SPISD_EVENT_STOP, stream == sdStream_Write, stream_next, 0, err);
+	}
+	stream = sdStream_None;
+
+	return err;
+}
+
+/*! Total number of sectors in a segment list */
+static uint32_t sd_segments_count(const sd_segment_t *seg, unsigned int nseg)
+{
+	uint32_t count = 0;
+
+	while (nseg--) {
+		count += seg++->count;
+	}
+	return count;
+}
+
+/*!
+ * Moves the sectors of a segment list with sector commands on the adapter
+ * (SPI_CAP_SECTORS), up to SPI_SECTORS_MAX sectors per command. The card is
+ * selected. SPI_SECTORS_OPEN in flags starts the transfer, SPI_SECTORS_CLOSE
+ * ends a multiple block transfer after the last sector. With SPI_CAP_BUFFERED
+ * the adapter moves each sector over the card SPI while the previous or next
+ * one crosses the parallel port.
+ */
+static int sd_sectors(bool write, uint32_t sector, const sd_segment_t *seg, unsigned int nseg, uint8_t flags)
+{
+	uint32_t count = sd_segments_count(seg, nseg), left = 0, n;
+	uint8_t expect = write ? 0 : 0xfe, status;
+	uint8_t *buf;
+	uint16_t chunk;
+	unsigned int phase = prof_enter(SPISD_PHASE_COMMAND);
+	unsigned int wait = write ? SPISD_PHASE_BUSY : SPISD_PHASE_TOKEN;
+
+	rx_ahead_pos = rx_ahead_len = 0;
+	sd_ready = false;
+
+	if (spi_get_caps() & SPI_CAP_BUFFERED) {
+		flags |= SPI_SECTORS_BUFFERED;
+	}
+
+	for (; nseg; seg++, nseg--) {
+		for (buf = seg->buf, n = seg->count; n; buf += SD_SECTOR_SIZE, n--) {
+			if (left == 0) {
+				chunk = count > SPI_SECTORS_MAX ? SPI_SECTORS_MAX : count;
+				count -= chunk;
+				prof_enter(SPISD_PHASE_COMMAND);
+				spi_sectors_begin(write, sd_addr(sector), chunk, count ? flags & ~SPI_SECTORS_CLOSE : flags);
+				left = chunk;
+			}
+
+			prof_enter(wait);
+			status = spi_sectors_status();
+			if (status != expect) {
+				spi_sectors_end();
+				prof_leave(phase);
+				ERROR("Sector transfer failed: %02x\n", status);
+				return status == 0xff ? sdError_Timeout : sdError_BadResponse;
+			}
+			prof_enter(SPISD_PHASE_DATA);
+			if (write) {
+				spi_sectors_write(buf);
+			} else {
+				spi_sectors_read(buf);
+			}
+
+			if (--left == 0) {
+				/* The last status includes CMD12/STOP_TRAN with CLOSE */
+				prof_enter(count == 0 && (flags & SPI_SECTORS_CLOSE) ? SPISD_PHASE_STOP : wait);
+				status = spi_sectors_status();
+				spi_sectors_end();
+				if (status != 0) {
+					prof_leave(phase);
+					ERROR("Sector transfer failed: %02x\n", status);
+					return status == 0xff ? sdError_Timeout : sdError_BadResponse;
+				}
+				/* Continued by the next command */
+				flags &= ~SPI_SECTORS_OPEN;
+			}
+		}
+	}
+
+	/* Reads leave the card ready, unless stopped by CMD12 */
+	sd_ready = !write && !(flags & SPI_SECTORS_CLOSE);
+	prof_leave(phase);
+
+	return 0;
+}
+
+static int sd_do_read(uint32_t sector, const sd_segment_t *seg, unsigned int nseg)
 {
 	sd_card_info_t *ci = &sd_card_info;
+	uint32_t count = sd_segments_count(seg, nseg), n;
+	bool offload = (spi_get_caps() & SPI_CAP_SECTORS) != 0;
+	uint8_t flags = SPI_SECTORS_MULTI;
+	uint8_t *buf;
 	int err = 0;
 
 	if (ci->type == sdCardType_None) {
 		ERROR("No card\n");
 		return sdError_NoCard;
 	}
-	if (ci->type != sdCardType_SDHC) {
-		/* Convert sector to byte addressing (x512) */
-		sector <<= 9;
+	if (count == 0) {
+		return 0;
 	}
 
-	if (count == 1) {
-		/* Read single sector */
-		//SERIAL("Read single sector ...\n");
-		if (sd_send_cmd(CMD17, sector) == 0) {
-			err = sd_read_block(buf, SD_SECTOR_SIZE);
-		} else {
-			err = sdError_BadResponse;
+	/* An open CMD18 is only continued by a request that follows on from it */
+	if (stream != sdStream_None && (stream != sdStream_Read || sector != stream_next || sd_stream_expired())) {
+		sd_flush();
+	}
+
+	if (stream == sdStream_None) {
+		if (count == 1 && sector != read_next) {
+			/* Isolated single sector, nothing is left open */
+			if (offload) {
+				err = sd_select();
+				if (err == 0) {
+					err = sd_sectors(false, sector, seg, nseg, SPI_SECTORS_OPEN);
+				}
+			} else if (sd_send_cmd(CMD17, sd_addr(sector)) == 0) {
+				err = sd_read_block(seg->buf, SD_SECTOR_SIZE);
+			} else {
+				err = sdError_BadResponse;
+			}
+			sd_deselect();
+			read_next = sector + 1;
+			return err;
+		}
+
+		/* Multiple sectors or sequential access, start an open-ended CMD18 */
+		if (offload) {
+			if (sd_select() < 0) {
+				return sdError_Timeout;
+			}
+			flags |= SPI_SECTORS_OPEN;
+		} else if (sd_send_cmd(CMD18, sd_addr(sector)) != 0) {
+			sd_deselect();
+			return sdError_BadResponse;
+		}
+		stream = sdStream_Read;
+		stream_next = sector;
+	}
+
+	if (offload) {
+		/* The adapter stops the transfer itself before the end of the card */
+		if (sector + count >= (uint32_t)(ci->capacity >> SD_SECTOR_SHIFT)) {
+			flags |= SPI_SECTORS_CLOSE;
+		}
+		err = sd_sectors(false, sector, seg, nseg, flags);
+		stream_next += count;
+		if (err == 0 && (flags & SPI_SECTORS_CLOSE)) {
+			stream = sdStream_None;
+			sd_deselect();
 		}
 	} else {
-		/* Read multiple sectors */
-		//SERIAL("Read multiple sectors ...\n");
-		if (sd_send_cmd(CMD18, sector) == 0) {
-			do {
+		for (; nseg && err == 0; seg++, nseg--) {
+			for (buf = seg->buf, n = seg->count; n; buf += SD_SECTOR_SIZE, n--) {
 				err = sd_read_block(buf, SD_SECTOR_SIZE);
 				if (err < 0) {
 					break;
 				}
-				buf += SD_SECTOR_SIZE;
-			} while (--count);
-
-			/* Send CMD12 stop transmission */
-			if (err == 0) {
-				err = sd_send_cmd(CMD12, 0);
+				stream_next++;
 			}
-		} else {
+		}
+	}
+
+	read_next = stream_next;
+	stream_tick = timer_get_tick_count();
+
+	/* Stop on error or before the card runs off its last sector */
+	if (err < 0 || stream_next >= (uint32_t)(ci->capacity >> SD_SECTOR_SHIFT)) {
+		sd_flush();
+	}
+
+	return err;
+}
+
+/*! Fails a transfer during which the adapter lost bytes (strobe mode), the
+ * open transfer is stopped since the card may be anywhere in it. */
+static int sd_check_fault(int err)
+{
+	if (spi_check_fault()) {
+		ERROR("Adapter lost bytes\n");
+		sd_flush();
+		if (err == 0) {
 			err = sdError_BadResponse;
 		}
 	}
+	return err;
+}
 
-	sd_deselect();
+int sd_read_segments(uint32_t sector, const sd_segment_t *seg, unsigned int nseg)
+{
+	int err = sd_check_fault(sd_do_read(sector, seg, nseg));
 
+	TRACE_EVENT(SPISD_EVENT_READ, 0, sector, sd_segments_count(seg, nseg), err);
 	return err;
 }
 
-int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+int sd_read(uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	sd_segment_t seg;
+
+	seg.buf = buf;
+	seg.count = count;
+	return sd_read_segments(sector, &seg, 1);
+}
+
+static int sd_do_write(uint32_t sector, const sd_segment_t *seg, unsigned int nseg)
 {
 	sd_card_info_t *ci = &sd_card_info;
+	uint32_t count = sd_segments_count(seg, nseg), n;
+	bool offload = (spi_get_caps() & SPI_CAP_SECTORS) != 0, preerase;
+	uint8_t flags = SPI_SECTORS_MULTI;
+	const uint8_t *buf;
 	int err = 0;
 
 	if (ci->type == sdCardType_None) {
 		ERROR("No card\n");
 		return sdError_NoCard;
 	}
-	if (ci->type != sdCardType_SDHC) {
-		/* Convert sector to byte addressing (x512) */
-		sector <<= 9;
+	if (count == 0) {
+		return 0;
 	}
 
-	if (count == 1) {
-		/* Write single sector */
-		if (sd_send_cmd(CMD24, sector) == 0) {
-			err = sd_write_block(buf, 0xfe);
+	/* An open CMD25 is only continued by a request that follows on from it */
+	if (stream != sdStream_None && (stream != sdStream_Write || sector != stream_next || sd_stream_expired())) {
+		sd_flush();
+	}
+
+	if (stream == sdStream_None) {
+		if (count == 1 && sector != write_next) {
+			/* Isolated single sector, nothing is left open */
+			if (offload) {
+				err = sd_select();
+				if (err == 0) {
+					err = sd_sectors(true, sector, seg, nseg, SPI_SECTORS_OPEN);
+				}
+			} else if (sd_send_cmd(CMD24, sd_addr(sector)) == 0) {
+				err = sd_write_block(seg->buf, 0xfe);
+			} else {
+				err = sdError_BadResponse;
+			}
+			sd_deselect();
+			write_next = sector + 1;
+			return err;
+		}
+
+		/* Pre-erase hint only, the transfer is still ended by STOP_TRAN */
+		preerase = ci->type == sdCardType_SD1_x || ci->type == sdCardType_SD2_0 || ci->type == sdCardType_SDHC;
+
+		/* Multiple sectors or sequential access, start an open-ended CMD25 */
+		if (offload) {
+			if (sd_select() < 0) {
+				return sdError_Timeout;
+			}
+			flags |= SPI_SECTORS_OPEN | (preerase ? SPI_SECTORS_PREERASE : 0);
 		} else {
-			err = sdError_BadResponse;
+			if (preerase) {
+				sd_send_cmd(ACMD23, count);
+			}
+			if (sd_send_cmd(CMD25, sd_addr(sector)) != 0) {
+				sd_deselect();
+				return sdError_BadResponse;
+			}
 		}
-	} else {
-		if (ci->type == sdCardType_SD1_x || ci->type == sdCardType_SD2_0 || ci->type == sdCardType_SDHC) {
-			/* Pre-defined sector count */
-			sd_send_cmd(ACMD23, count);
+		stream = sdStream_Write;
+		stream_next = sector;
+	}
+
+	if (offload) {
+		/* The adapter stops the transfer itself at the end of the card */
+		if (sector + count >= (uint32_t)(ci->capacity >> SD_SECTOR_SHIFT)) {
+			flags |= SPI_SECTORS_CLOSE;
 		}
-		/* Write multiple sectors */
-		if (sd_send_cmd(CMD25, sector) == 0) {
-			do {
+		err = sd_sectors(true, sector, seg, nseg, flags);
+		stream_next += count;
+		if (err == 0 && (flags & SPI_SECTORS_CLOSE)) {
+			stream = sdStream_None;
+			sd_deselect();
+		}
+	} else {
+		for (; nseg && err == 0; seg++, nseg--) {
+			for (buf = seg->buf, n = seg->count; n; buf += SD_SECTOR_SIZE, n--) {
 				err = sd_write_block(buf, 0xfc);
 				if (err < 0) {
 					break;
 				}
-				buf += SD_SECTOR_SIZE;
-			} while (--count);
-
-			/* Send STOP_TRAN */
-			if (err == 0) {
-				err = sd_write_block(0, 0xfd);
+				stream_next++;
 			}
-		} else {
-			err = sdError_BadResponse;
 		}
 	}
 
-	sd_deselect();
+	write_next = stream_next;
+	stream_tick = timer_get_tick_count();
+
+	if (err < 0) {
+		sd_flush();
+	} else if (stream_next >= (uint32_t)(ci->capacity >> SD_SECTOR_SHIFT)) {
+		/* Stop at the last sector of the card */
+		err = sd_flush();
+	}
 
 	return err;
 }
 
+int sd_write_segments(uint32_t sector, const sd_segment_t *seg, unsigned int nseg)
+{
+	int err = sd_check_fault(sd_do_write(sector, seg, nseg));
+
+	TRACE_EVENT(SPISD_EVENT_WRITE, 0, sector, sd_segments_count(seg, nseg), err);
+	return err;
+}
+
+int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count)
+{
+	sd_segment_t seg;
+
+	seg.buf = (uint8_t*)buf;
+	seg.count = count;
+	return sd_write_segments(sector, &seg, 1);
+}
+
 const sd_card_info_t* sd_get_card_info(void)
 {
 	return &sd_card_info;
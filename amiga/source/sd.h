@@ -25,6 +25,9 @@
 #define SD_SECTOR_SIZE		512
 #define SD_SECTOR_SHIFT		9
 
+/*! Idle time after which an open multiple-block transfer is not continued */
+#define SD_STREAM_IDLE_MS	500
+
 typedef enum {
 	sdError_OK = 0,
 	sdError_NoCard = -1,
@@ -110,10 +113,26 @@ typedef struct {
 	sd_card_cid_t		cid;
 } sd_card_info_t;
 
+/*! Part of a transfer of consecutive sectors to or from separate buffers */
+typedef struct {
+	uint8_t				*buf;
+	uint32_t			count;				/*!< number of sectors */
+} sd_segment_t;
+
 int sd_open(void);
 void sd_close(void);
 int sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
 int sd_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+int sd_read_segments(uint32_t sector, const sd_segment_t *seg, unsigned int nseg);
+int sd_write_segments(uint32_t sector, const sd_segment_t *seg, unsigned int nseg);
+int sd_flush(void);
 const sd_card_info_t* sd_get_card_info(void);
 
+/*! Read ahead on the adapter for sequential reads, if it has SPI_CAP_PREFETCH.
+ * On by default. */
+void sd_set_prefetch(bool enable);
+/*! Sectors read ahead by the adapter that were used (hits) and dropped
+ * (misses). Stops an open transfer. */
+void sd_get_prefetch_stats(uint32_t *hits, uint32_t *misses);
+
 #endif
@@ -5,6 +5,14 @@
 
 	.global		_spi_read_fast
 	.global		_spi_write_fast
+	.global		_spi_read_fast_020
+	.global		_spi_write_fast_020
+	.global		_spi_read_payload
+	.global		_spi_write_payload
+	.global		_spi_read_payload_020
+	.global		_spi_write_payload_020
+	.global		_spi_read_strobe
+	.global		_spi_write_strobe
 
 CIAB_PRTRSEL	=	(2)
 CIAB_PRTRPOUT	=	(1)
@@ -26,18 +34,13 @@ CLOCK_BIT	=	CIAB_PRTRPOUT
 IDLE_BIT	=	CIAB_PRTRBUSY
 
 /*
- * a0 = unsigned char *buf
- * d0 = unsigned int size
- * assert: 1 <= size < 2^13 (three top bits are zeros)
+ * Start of a write: Disable(), wait until the adapter is idle and send the
+ * WRITE1/WRITE2 command. The data pins are left driven.
+ * d0 = size (1 <= size < 2^13)
+ * out: a1 = data port, a5 = control port, d2 = control port value, a6 = SysBase
  */
 
-_spi_write_fast:
-	and		#0x1fff,d0
-	bne.b		.not_zero1
-	rts
-
-.not_zero1:
-	movem.l		d2/a5-a6,-(a7)
+.start_write:
 	move.l		4.w,a6
 	jsr		Disable(a6)
 
@@ -82,49 +85,27 @@ _spi_write_fast:
 
 .cmd_sent1:
 	addq		#1,d0			| d0 = size
+	rts
 
-	btst		#0,d0
-	beq.b		.even1
-
-	move.b		(a0)+,(a1)
-	bchg		#CLOCK_BIT,d2
-	move.b		d2,(a5)
-
-.even1:
-	lsr		#1,d0
-	beq.b		.done1
-	subq		#1,d0
-
-	move.b		d2,d1
-	bchg		#CLOCK_BIT,d1
-
-.loop1:
-	move.b		(a0)+,(a1)
-	move.b		d1,(a5)
-	move.b		(a0)+,(a1)
-	move.b		d2,(a5)
-	dbra		d0,.loop1
+/*
+ * End of a write, jumped to by the write kernels
+ */
 
-.done1:
+.end_write:
 	move.b		#0,0x200(a1)		| Stop driving data pins
 
 	jsr		Enable(a6)
-	movem.l		(a7)+,d2/a5-a6
+	movem.l		(a7)+,d2-d3/a5-a6
 	rts
 
 /*
-* a0 = unsigned char *buf
-* d0 = unsigned int size
-* assert: 1 <= size < 2^13 (three top bits are zeros)
-*/
-
-_spi_read_fast:
-	and		#0x1fff,d0
-	bne.b		.not_zero2
-	rts
+ * Start of a read: Disable(), wait until the adapter is idle and send the
+ * READ1/READ2 command. The data pins are released.
+ * d0 = size (1 <= size < 2^13)
+ * out: a1 = data port, a5 = control port, d2 = control port value, a6 = SysBase
+ */
 
-.not_zero2:
-	movem.l		d2/a5-a6,-(a7)
+.start_read:
 	move.l		4.w,a6
 	jsr		Disable(a6)
 
@@ -173,16 +154,129 @@ _spi_read_fast:
 	move.b		#0,0x200(a1)		| Stop driving data pins
 
 	addq		#1,d0			| d0 = size
+	rts
+
+/*
+ * Start of a payload transfer inside an extended command (READ_SECTORS,
+ * WRITE_SECTORS): the adapter already waits for POUT toggles, so Disable()
+ * and set up the registers only. The data pins are not touched.
+ * out: a1 = data port, a5 = control port, d2 = control port value, a6 = SysBase
+ */
+
+.start_payload:
+	move.l		4.w,a6
+	jsr		Disable(a6)
+
+	lea.l		CIAA_BASE+CIAPRB,a1	| Data
+	lea.l		CIAB_BASE+CIAPRA,a5	| Control pins
+	move.b		(a5),d2
+	rts
+
+/*
+ * End of a read, jumped to by the read kernels. The word on the stack says
+ * whether the last byte is followed by a toggle (commands) or not (payload,
+ * the caller toggles once the whole payload is in).
+ */
+
+.end_read:
+	tst.w		(a7)+
+	beq.b		.no_toggle
+
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+
+.no_toggle:
+	jsr		Enable(a6)
+	movem.l		(a7)+,d2-d3/a5-a6
+	rts
+
+/*
+ * 68000 kernels, one byte per CIA access pair, unrolled 8x
+ *
+ * a0 = unsigned char *buf
+ * d0 = unsigned int size
+ * assert: 1 <= size < 2^13 (three top bits are zeros)
+ */
+
+_spi_write_fast:
+	and		#0x1fff,d0
+	bne.b		.not_zero1
+	rts
+
+.not_zero1:
+	movem.l		d2-d3/a5-a6,-(a7)
+	bsr		.start_write
 
-	btst		#0,d0
-	beq.b		.even2
+.body1:
 
+	| Single bytes until the rest is a multiple of 8
+	move		d0,d3
+	and		#7,d3
+	bra.b		.single1_next
+
+.single1:
+	move.b		(a0)+,(a1)
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+
+.single1_next:
+	dbra		d3,.single1
+
+	lsr		#3,d0
+	beq.b		.done1
+	subq		#1,d0
+
+	move.b		d2,d1
+	bchg		#CLOCK_BIT,d1
+
+.loop1:
+	move.b		(a0)+,(a1)
+	move.b		d1,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d2,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d1,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d2,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d1,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d2,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d1,(a5)
+	move.b		(a0)+,(a1)
+	move.b		d2,(a5)
+	dbra		d0,.loop1
+
+.done1:
+	bra		.end_write
+
+_spi_read_fast:
+	and		#0x1fff,d0
+	bne.b		.not_zero2
+	rts
+
+.not_zero2:
+	movem.l		d2-d3/a5-a6,-(a7)
+	move.w		#1,-(a7)		| Toggle at the end
+	bsr		.start_read
+
+.body2:
+
+	| Single bytes until the rest is a multiple of 8
+	move		d0,d3
+	and		#7,d3
+	bra.b		.single2_next
+
+.single2:
 	bchg		#CLOCK_BIT,d2
 	move.b		d2,(a5)
 	move.b		(a1),(a0)+
 
-.even2:
-	lsr		#1,d0
+.single2_next:
+	dbra		d3,.single2
+
+	lsr		#3,d0
 	beq.b		.done2
 	subq		#1,d0
 
@@ -190,6 +284,18 @@ _spi_read_fast:
 	bchg		#CLOCK_BIT,d1
 
 .loop2:
+	move.b		d1,(a5)
+	move.b		(a1),(a0)+
+	move.b		d2,(a5)
+	move.b		(a1),(a0)+
+	move.b		d1,(a5)
+	move.b		(a1),(a0)+
+	move.b		d2,(a5)
+	move.b		(a1),(a0)+
+	move.b		d1,(a5)
+	move.b		(a1),(a0)+
+	move.b		d2,(a5)
+	move.b		(a1),(a0)+
 	move.b		d1,(a5)
 	move.b		(a1),(a0)+
 	move.b		d2,(a5)
@@ -197,9 +303,352 @@ _spi_read_fast:
 	dbra		d0,.loop2
 
 .done2:
+	bra		.end_read
+
+/*
+ * 68020+ kernels, the buffer is accessed a longword at a time (unaligned
+ * accesses are allowed) and bytes are shifted in and out of a register
+ * between the CIA accesses
+ *
+ * a0 = unsigned char *buf
+ * d0 = unsigned int size
+ * assert: 1 <= size < 2^13 (three top bits are zeros)
+ */
+
+_spi_write_fast_020:
+	and		#0x1fff,d0
+	bne.b		.not_zero3
+	rts
+
+.not_zero3:
+	movem.l		d2-d3/a5-a6,-(a7)
+	bsr		.start_write
+
+.body3:
+
+	| Single bytes until the rest is a multiple of 4
+	move		d0,d3
+	and		#3,d3
+	bra.b		.single3_next
+
+.single3:
+	move.b		(a0)+,(a1)
 	bchg		#CLOCK_BIT,d2
 	move.b		d2,(a5)
 
+.single3_next:
+	dbra		d3,.single3
+
+	lsr		#2,d0
+	beq.b		.done3
+	subq		#1,d0
+
+	move.b		d2,d1
+	bchg		#CLOCK_BIT,d1
+
+.loop3:
+	move.l		(a0)+,d3
+	rol.l		#8,d3
+	move.b		d3,(a1)
+	move.b		d1,(a5)
+	rol.l		#8,d3
+	move.b		d3,(a1)
+	move.b		d2,(a5)
+	rol.l		#8,d3
+	move.b		d3,(a1)
+	move.b		d1,(a5)
+	rol.l		#8,d3
+	move.b		d3,(a1)
+	move.b		d2,(a5)
+	dbra		d0,.loop3
+
+.done3:
+	bra		.end_write
+
+_spi_read_fast_020:
+	and		#0x1fff,d0
+	bne.b		.not_zero4
+	rts
+
+.not_zero4:
+	movem.l		d2-d3/a5-a6,-(a7)
+	move.w		#1,-(a7)		| Toggle at the end
+	bsr		.start_read
+
+.body4:
+
+	| Single bytes until the rest is a multiple of 4
+	move		d0,d3
+	and		#3,d3
+	bra.b		.single4_next
+
+.single4:
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+	move.b		(a1),(a0)+
+
+.single4_next:
+	dbra		d3,.single4
+
+	lsr		#2,d0
+	beq.b		.done4
+	subq		#1,d0
+
+	move.b		d2,d1
+	bchg		#CLOCK_BIT,d1
+
+.loop4:
+	move.b		d1,(a5)
+	move.b		(a1),d3
+	lsl.l		#8,d3
+	move.b		d2,(a5)
+	move.b		(a1),d3
+	lsl.l		#8,d3
+	move.b		d1,(a5)
+	move.b		(a1),d3
+	lsl.l		#8,d3
+	move.b		d2,(a5)
+	move.b		(a1),d3
+	move.l		d3,(a0)+
+	dbra		d0,.loop4
+
+.done4:
+	bra		.end_read
+
+/*
+ * Payload entries of the kernels above, for the sector data of
+ * READ_SECTORS/WRITE_SECTORS. No command is sent, and reads end without a
+ * toggle so that a sector can be moved in several calls.
+ *
+ * a0 = unsigned char *buf
+ * d0 = unsigned int size
+ * assert: 1 <= size < 2^13 (three top bits are zeros)
+ */
+
+_spi_write_payload:
+	and		#0x1fff,d0
+	beq.b		.payload_none
+	movem.l		d2-d3/a5-a6,-(a7)
+	bsr		.start_payload
+	move.b		#0xff,0x200(a1)		| Start driving data pins
+	bra		.body1
+
+_spi_write_payload_020:
+	and		#0x1fff,d0
+	beq.b		.payload_none
+	movem.l		d2-d3/a5-a6,-(a7)
+	bsr		.start_payload
+	move.b		#0xff,0x200(a1)		| Start driving data pins
+	bra		.body3
+
+_spi_read_payload:
+	and		#0x1fff,d0
+	beq.b		.payload_none
+	movem.l		d2-d3/a5-a6,-(a7)
+	clr.w		-(a7)			| No toggle at the end
+	bsr		.start_payload
+	bra		.body2
+
+_spi_read_payload_020:
+	and		#0x1fff,d0
+	beq.b		.payload_none
+	movem.l		d2-d3/a5-a6,-(a7)
+	clr.w		-(a7)			| No toggle at the end
+	bsr		.start_payload
+	bra		.body4
+
+.payload_none:
+	rts
+
+/*
+ * Strobe mode (firmware built with STROBE_MODE, STROBE wired to the AVR)
+ *
+ * CIA-A pulses /PC (STROBE) on every access to PRB, the AVR uses that pulse
+ * as the byte clock so that each data byte costs one CIA access instead of
+ * a data access and a POUT toggle. The command is sent with POUT toggles as
+ * usual: STROBE_WRITE/STROBE_READ = 1100001x, followed by size - 1 as two
+ * bytes (high, low). The AVR raises BUSY when it is ready for the first
+ * strobe (with the first byte on the bus when reading). A CIA-B read after
+ * every four bytes keeps fast CPUs from outpacing the AVR. The AVR drops
+ * BUSY after the last strobe, it is still high if a strobe was lost or
+ * merged with another one (the AVR gives up on its own after about 30 ms).
+ *
+ * a0 = unsigned char *buf
+ * d0 = unsigned int size
+ * assert: 1 <= size < 2^13 (three top bits are zeros)
+ * out: d0 = 0, 1 if BUSY never went high (nothing was transferred) or 2 if
+ *      it stayed high after the last byte (the data is not reliable)
+ */
+
+STROBE_WRITE	=	0xc2
+STROBE_READ	=	0xc3
+
+/*
+ * d0 = size, d3 = STROBE_WRITE or STROBE_READ
+ * out: a1 = data port, a5 = control port, d2 = control port value, a6 = SysBase
+ */
+
+.start_strobe:
+	move.l		4.w,a6
+	jsr		Disable(a6)
+
+	lea.l		CIAA_BASE+CIAPRB,a1	| Data
+	lea.l		CIAB_BASE+CIAPRA,a5	| Control pins
+
+.idle_wait3:
+	move.b		(a5),d2
+	btst		#IDLE_BIT,d2
+	beq.b		.is_idle3
+
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+	bra.b		.idle_wait3
+
+.is_idle3:
+	move.b		#0xff,0x200(a1)		| Start driving data pins
+
+	subq		#1,d0			| d0 = size - 1
+
+	move.b		d3,(a1)
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+
+	move		d0,d1
+	lsr		#8,d1
+	move.b		d1,(a1)
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+
+	move.b		d0,(a1)
+	bchg		#CLOCK_BIT,d2
+	move.b		d2,(a5)
+
+	addq		#1,d0			| d0 = size
+
+	btst		#0,d3
+	beq.b		.strobe_ready
+	move.b		#0,0x200(a1)		| Stop driving data pins
+
+.strobe_ready:
+	move		#0xffff,d1		| Bounded wait for BUSY high
+
+.strobe_wait:
+	btst		#IDLE_BIT,(a5)
+	dbne		d1,.strobe_wait
+	rts
+
+/*
+ * End of a strobe transfer: releases the data pins, checks that BUSY drops
+ * and calls Enable(). d0 = result as above.
+ */
+
+.end_strobe:
+	move.b		#0,0x200(a1)		| Stop driving data pins
+	moveq		#0,d3
+	move		#255,d1			| Bounded wait for BUSY low, a few us are enough
+
+.strobe_done_wait:
+	btst		#IDLE_BIT,(a5)
+	dbeq		d1,.strobe_done_wait
+	beq.b		.strobe_exit
+	moveq		#2,d3
+	bra.b		.strobe_exit
+
+.strobe_lost:
+	move.b		#0,0x200(a1)		| Stop driving data pins
+	moveq		#1,d3
+
+.strobe_exit:
 	jsr		Enable(a6)
-	movem.l		(a7)+,d2/a5-a6
+	move.l		d3,d0
+	movem.l		(a7)+,d2-d3/a5-a6
 	rts
+
+_spi_write_strobe:
+	and		#0x1fff,d0
+	bne.b		.not_zero5
+	rts
+
+.not_zero5:
+	movem.l		d2-d3/a5-a6,-(a7)
+	move		#STROBE_WRITE,d3
+	bsr		.start_strobe
+	btst		#IDLE_BIT,(a5)		| Still low if the wait timed out
+	beq		.strobe_lost
+
+	| Single bytes until the rest is a multiple of 8
+	move		d0,d3
+	and		#7,d3
+	bra.b		.single5_next
+
+.single5:
+	move.b		(a0)+,(a1)
+	tst.b		(a5)
+
+.single5_next:
+	dbra		d3,.single5
+
+	lsr		#3,d0
+	beq.b		.done5
+	subq		#1,d0
+
+.loop5:
+	move.b		(a0)+,(a1)
+	move.b		(a0)+,(a1)
+	move.b		(a0)+,(a1)
+	move.b		(a0)+,(a1)
+	tst.b		(a5)
+	move.b		(a0)+,(a1)
+	move.b		(a0)+,(a1)
+	move.b		(a0)+,(a1)
+	move.b		(a0)+,(a1)
+	tst.b		(a5)
+	dbra		d0,.loop5
+
+.done5:
+	bra		.end_strobe
+
+_spi_read_strobe:
+	and		#0x1fff,d0
+	bne.b		.not_zero6
+	rts
+
+.not_zero6:
+	movem.l		d2-d3/a5-a6,-(a7)
+	move		#STROBE_READ,d3
+	bsr		.start_strobe
+	btst		#IDLE_BIT,(a5)		| Still low if the wait timed out
+	beq		.strobe_lost
+
+	| Single bytes until the rest is a multiple of 8
+	move		d0,d3
+	and		#7,d3
+	bra.b		.single6_next
+
+.single6:
+	move.b		(a1),(a0)+
+	tst.b		(a5)
+
+.single6_next:
+	dbra		d3,.single6
+
+	lsr		#3,d0
+	beq.b		.done6
+	subq		#1,d0
+
+.loop6:
+	move.b		(a1),(a0)+
+	move.b		(a1),(a0)+
+	move.b		(a1),(a0)+
+	move.b		(a1),(a0)+
+	tst.b		(a5)
+	move.b		(a1),(a0)+
+	move.b		(a1),(a0)+
+	move.b		(a1),(a0)+
+	move.b		(a1),(a0)+
+	tst.b		(a5)
+	dbra		d0,.loop6
+
+.done6:
+	| The AVR releases the data pins after the last strobe
+	bra		.end_strobe
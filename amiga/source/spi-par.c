@@ -3,8 +3,12 @@
  * Written in the end of April 2020 by Niklas Ekström
  */
 
+#include <exec/execbase.h>
+#include <string.h>
+
 #include "common.h"
 #include "spi-par.h"
+#include "prof.h"
 
 #define	CIAB_PRTRSEL	2
 #define	CIAB_PRTRPOUT	1
@@ -20,21 +24,85 @@
 
 #define DEVICE_TIMEOUT_MS	50
 
+// Extended commands, 11xxxxxx after the speed (and strobe) commands
+#define EXT_COMMAND		0xc4
+#define EXT_WAIT_TOKEN	0xc5
+#define EXT_WAIT_READY	0xc6
+#define EXT_READ_SECTORS	0xc7
+#define EXT_WRITE_SECTORS	0xc8
+#define EXT_PREFETCH		0xc9
+#define EXT_QUERY		0xca
+
+#define QUERY_MAGIC		0x53
+
+// ACK pulse when BUSY drops, in the high timeout byte of WAIT_TOKEN/WAIT_READY and in the sector flags
+#define WAIT_NOTIFY		0x80
+#define SECTORS_NOTIFY	0x20
+
+// Longest wait for a data token or for the card to stop being busy, set by the adapter firmware
+#define SECTORS_TIMEOUT_MS	500
+
 static volatile uint8_t *cia_a_prb = (volatile uint8_t *)0xbfe101;
 static volatile uint8_t *cia_a_ddrb = (volatile uint8_t *)0xbfe301;
 
 static volatile uint8_t *cia_b_pra = (volatile uint8_t *)0xbfd000;
 static volatile uint8_t *cia_b_ddra = (volatile uint8_t *)0xbfd200;
 
+// VPOSR/VHPOSR, beam position in lines and colour clocks (280 ns).
+static volatile uint32_t *beam = (volatile uint32_t *)0xdff004;
+
+#define BEAM_LINE_CC	227
+
 static spi_speed_t current_speed = spiSpeed_Slow;
 
+/* Use the 68020+ transfer kernels */
+static bool cpu_020;
+
+/* Capabilities the driver may use, to test without some of them */
+#ifndef SPI_CAPS_MASK
+#define SPI_CAPS_MASK		0xff
+#endif
+
+/* Adapter capabilities (SPI_CAP_*) and firmware version from spi_probe() */
+static uint8_t caps;
+static uint8_t version;
+
+/* Sleep while the adapter is busy (SPI_CAP_NOTIFY). FLAG interrupts counted
+ * by the caller during commands that asked for ACK pulses are taken as pulses. */
+static spi_sleep_t sleep_fn;
+static volatile uint32_t *flag_count;
+static uint32_t notify_count;
+static uint32_t notify_from;
+static bool sectors_notify;
+
+/* A strobe transfer lost bytes since spi_check_fault() */
+static bool strobe_fault;
+
+/* Strobe mode is only used when asked for, see spi_set_strobe() */
+static bool strobe_enabled;
+
+/* Longest fast transfer done in one Disable() window, 0 for no limit */
+static unsigned int max_transfer;
+
+/* Longest Disable() window seen, in colour clocks */
+static uint32_t frame_cc;
+static uint32_t max_disabled_cc;
+
 void spi_init(void)
 {
+	struct ExecBase *sys = *(struct ExecBase **)4;
+
+	cpu_020 = (sys->AttnFlags & AFF_68020) != 0;
+	frame_cc = (sys->VBlankFrequency == 50 ? 313 : 263) * BEAM_LINE_CC;
+
 	// Should allocate the parallel port in a system friendly way?
 	*cia_b_pra = (*cia_b_pra & ~IDLE_MASK) | (CS_MASK | CLOCK_MASK);
 	*cia_b_ddra = (*cia_b_ddra & ~IDLE_MASK) | (CS_MASK | CLOCK_MASK);
 	*cia_a_prb = 0xff;
 	*cia_a_ddrb = 0;
+
+	caps = 0;
+	version = 0;
 }
 
 void spi_shutdown(void)
@@ -45,10 +113,17 @@ void spi_shutdown(void)
 
 static void wait_until_idle(void)
 {
-	// Timeout so that this will not block forever if the adapter is not present.
-	uint32_t timeout = timer_get_tick_count() + TIMER_MILLIS(DEVICE_TIMEOUT_MS);
+	uint32_t timeout;
+	unsigned int phase;
 	
 	uint8_t ctrl = *cia_b_pra;
+	if (!(ctrl & IDLE_MASK))
+		return;
+
+	// Only timed when the adapter is still busy, this is called for every transaction.
+	phase = prof_enter(SPISD_PHASE_IDLE);
+	// Timeout so that this will not block forever if the adapter is not present.
+	timeout = timer_get_tick_count() + TIMER_MILLIS(DEVICE_TIMEOUT_MS);
 	while (ctrl & IDLE_MASK)
 	{
 		ctrl ^= CLOCK_MASK;
@@ -59,6 +134,7 @@ static void wait_until_idle(void)
 			break;
 		}
 	}
+	prof_leave(phase);
 }
 
 void spi_set_speed(spi_speed_t speed)
@@ -184,21 +260,448 @@ static void spi_read_slow(uint8_t *buf, unsigned int size)
 	*cia_b_pra = ctrl;
 }
 
+// Extended commands: the opcode and its parameters are clocked out like a
+// write. The adapter raises BUSY as soon as it sees the opcode and works on
+// its own, then drops BUSY with the first reply byte on the data pins. The
+// following reply bytes come one per POUT toggle, one more toggle ends the
+// command.
+static void spi_ext_begin(uint8_t op, const uint8_t *param, unsigned int param_len)
+{
+	unsigned int i;
+	uint8_t ctrl;
+
+	wait_until_idle();
+
+	*cia_a_ddrb = 0xff;
+
+	ctrl = *cia_b_pra;
+
+	*cia_a_prb = op;
+	ctrl ^= CLOCK_MASK;
+	*cia_b_pra = ctrl;
+
+	for (i = 0; i < param_len; i++)
+	{
+		*cia_a_prb = *param++;
+
+		ctrl ^= CLOCK_MASK;
+		*cia_b_pra = ctrl;
+	}
+
+	*cia_a_ddrb = 0;
+}
+
+static bool notify_on(void)
+{
+	return (caps & SPI_CAP_NOTIFY) && sleep_fn && flag_count;
+}
+
+// Starts taking FLAG interrupts for ACK pulses, before the command that asks for them.
+static void notify_begin(void)
+{
+	notify_from = *flag_count;
+}
+
+// Takes the FLAG interrupts since notify_begin() for ACK pulses, whether the pulse arrived
+// or not, so that a lost or an extra pulse is never taken for a card detect change. The
+// pulse comes before BUSY drops, so its interrupt has been handled by the time BUSY is low.
+static void notify_end(void)
+{
+	uint32_t now = *flag_count;
+
+	notify_count += now - notify_from;
+	notify_from = now;
+}
+
+// Waits for BUSY to drop, allowing work_ms for the adapter plus DEVICE_TIMEOUT_MS.
+// With notify the adapter pulses ACK as BUSY drops, so the task can sleep meanwhile,
+// else long waits sleep between the polls.
+static bool spi_ext_wait(unsigned int work_ms, bool notify)
+{
+	timer_wait_t w;
+	uint32_t timeout;
+	int32_t left;
+
+	timer_wait_begin(&w);
+	timeout = w.start + TIMER_MILLIS(work_ms + DEVICE_TIMEOUT_MS);
+
+	while (*cia_b_pra & IDLE_MASK)
+	{
+		if (notify)
+		{
+			left = (int32_t)(timeout - timer_get_tick_count());
+			if (left <= 0)
+				return false;
+			sleep_fn(TIMER_TO_MILLIS(left));
+		}
+		else if ((int32_t)(timer_wait_poll(&w) - timeout) >= 0)
+			return false;
+	}
+	return true;
+}
+
+// A whole extended command, the reply is all 0xff if the adapter does not answer in time
+static void spi_ext(uint8_t op, const uint8_t *param, unsigned int param_len,
+		uint8_t *reply, unsigned int reply_len, unsigned int work_ms, bool notify)
+{
+	unsigned int i;
+	uint8_t ctrl;
+
+	spi_ext_begin(op, param, param_len);
+
+	if (!spi_ext_wait(work_ms, notify))
+	{
+		for (i = 0; i < reply_len; i++)
+			reply[i] = 0xff;
+		return;
+	}
+
+	ctrl = *cia_b_pra;
+
+	*reply++ = *cia_a_prb;
+
+	for (i = 1; i < reply_len; i++)
+	{
+		ctrl ^= CLOCK_MASK;
+		*cia_b_pra = ctrl;
+
+		*reply++ = *cia_a_prb;
+	}
+
+	ctrl ^= CLOCK_MASK;
+	*cia_b_pra = ctrl;
+}
+
+// COMMAND: parameter byte (polls << 4 | skip << 3 | extra), then the frame
+void spi_command(const uint8_t *frame, bool skip, unsigned int polls,
+		uint8_t *resp, unsigned int extra)
+{
+	uint8_t param[1 + SPI_COMMAND_FRAME];
+	int i;
+
+	param[0] = (polls << 4) | (skip ? 0x08 : 0) | extra;
+	for (i = 0; i < SPI_COMMAND_FRAME; i++)
+		param[1 + i] = frame[i];
+
+	spi_ext(EXT_COMMAND, param, sizeof(param), resp, 1 + extra, 0, false);
+}
+
+// WAIT_TOKEN/WAIT_READY: timeout in ms as two bytes, most significant first,
+// and WAIT_NOTIFY. The reply is the token, or 0 when the card became ready.
+static uint8_t spi_wait(uint8_t op, unsigned int timeout_ms)
+{
+	uint8_t param[2];
+	uint8_t last;
+	bool notify = notify_on();
+
+	param[0] = (timeout_ms >> 8) | (notify ? WAIT_NOTIFY : 0);
+	param[1] = timeout_ms;
+
+	if (notify)
+		notify_begin();
+	spi_ext(op, param, sizeof(param), &last, 1, timeout_ms, notify);
+	if (notify)
+		notify_end();
+	return last;
+}
+
+uint8_t spi_wait_token(unsigned int timeout_ms)
+{
+	return spi_wait(EXT_WAIT_TOKEN, timeout_ms);
+}
+
+bool spi_wait_ready(unsigned int timeout_ms)
+{
+	return spi_wait(EXT_WAIT_READY, timeout_ms) == 0;
+}
+
+// PREFETCH: the mode byte. The reply is the hits and misses, two bytes each,
+// most significant first.
+bool spi_prefetch(uint8_t mode, uint16_t *hits, uint16_t *misses)
+{
+	uint8_t reply[4];
+
+	spi_ext(EXT_PREFETCH, &mode, 1, reply, sizeof(reply), 0, false);
+
+	*hits = (reply[0] << 8) | reply[1];
+	*misses = (reply[2] << 8) | reply[3];
+	return !(*hits == 0xffff && *misses == 0xffff);
+}
+
+extern int spi_read_strobe(register uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+extern int spi_write_strobe(register const uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+
+// A strobe transfer returns 1 if the adapter never took it, nothing moved
+// and the chunk is sent again with POUT toggles, and 2 if a strobe was lost
+// or merged with another one. Either way strobe mode is not used again
+// until the next spi_probe().
+static bool strobe_failed(int res)
+{
+	ERROR("Strobe transfer failed (%d), using POUT transfers\n", res);
+	caps &= ~SPI_CAP_STROBE;
+	if (res == 1)
+		return true;
+	strobe_fault = true;
+	return false;
+}
+
+// Sends 0xff bytes and reads as many with strobe transfers, the card ignores
+// them between commands. Strobe mode is only used if none of them fails.
+static void spi_test_strobe(void)
+{
+	uint8_t buf[64];
+	unsigned int i;
+	int res;
+
+	memset(buf, 0xff, sizeof(buf));
+	for (i = 0; i < 16; i++) {
+		res = (i & 1) ? spi_read_strobe(buf, sizeof(buf)) : spi_write_strobe(buf, sizeof(buf));
+		if (res) {
+			strobe_failed(res);
+			strobe_fault = false;
+			return;
+		}
+	}
+}
+
+// QUERY: one reserved byte, 0xff. The reply is QUERY_MAGIC, the firmware
+// version and its capabilities. Firmware without QUERY ignores the command
+// and the reserved byte (11111111 is no command either) and leaves the data
+// pins undriven, so the reply reads as 0xff.
+uint8_t spi_probe(void)
+{
+	uint8_t param = 0xff;
+	uint8_t reply[3];
+
+	spi_ext(EXT_QUERY, &param, 1, reply, sizeof(reply), 0, false);
+
+	if (reply[0] == QUERY_MAGIC) {
+		version = reply[1];
+		caps = reply[2] & SPI_CAPS_MASK;
+		if (!strobe_enabled)
+			caps &= ~SPI_CAP_STROBE;
+		else if (caps & SPI_CAP_STROBE)
+			spi_test_strobe();
+	} else {
+		version = 0;
+		caps = 0;
+	}
+	return caps;
+}
+
+bool spi_check_fault(void)
+{
+	bool fault = strobe_fault;
+
+	strobe_fault = false;
+	return fault;
+}
+
+uint8_t spi_get_version(void)
+{
+	return version;
+}
+
+uint8_t spi_get_caps(void)
+{
+	return caps;
+}
+
+void spi_set_sleep(spi_sleep_t sleep)
+{
+	sleep_fn = sleep;
+}
+
+void spi_set_flag_count(volatile uint32_t *count)
+{
+	flag_count = count;
+}
+
+uint32_t spi_get_notify_count(void)
+{
+	return notify_count;
+}
+
+void spi_set_max_transfer(unsigned int bytes)
+{
+	max_transfer = bytes;
+}
+
+void spi_set_strobe(bool enable)
+{
+	strobe_enabled = enable;
+}
+
+uint32_t spi_get_max_disabled_us(void)
+{
+	return max_disabled_cc * 2794ul / 10000ul;
+}
+
+void spi_reset_max_disabled(void)
+{
+	max_disabled_cc = 0;
+}
+
+static uint32_t beam_position(void)
+{
+	uint32_t v = *beam;
+
+	return ((v >> 8) & 0x1ff) * BEAM_LINE_CC + (v & 0xff);
+}
+
+// Records the time since start, a transfer is far shorter than one frame.
+static void update_max_disabled(uint32_t start)
+{
+	int32_t cc = (int32_t)(beam_position() - start);
+
+	if (cc < 0)
+		cc += frame_cc;
+	if (cc > max_disabled_cc)
+		max_disabled_cc = cc;
+}
+
 extern void spi_read_fast(register uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
 extern void spi_write_fast(register const uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
-
+extern void spi_read_fast_020(register uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+extern void spi_write_fast_020(register const uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+// Each chunk is a complete READ/WRITE command to the adapter, so splitting a
+// transfer costs one command header per chunk but never loses sync with it.
+// Interrupts are enabled between the chunks.
 void spi_read(uint8_t *buf, unsigned int size)
 {
-	if (current_speed == spiSpeed_Fast)
-		spi_read_fast(buf, size);
-	else
+	unsigned int chunk;
+	uint32_t start;
+
+	if (current_speed != spiSpeed_Fast) {
 		spi_read_slow(buf, size);
+		return;
+	}
+
+	while (size) {
+		chunk = (max_transfer && size > max_transfer) ? max_transfer : size;
+		start = beam_position();
+		if (caps & SPI_CAP_STROBE) {
+			int res = spi_read_strobe(buf, chunk);
+			if (res && strobe_failed(res))
+				continue;
+		} else if (cpu_020)
+			spi_read_fast_020(buf, chunk);
+		else
+			spi_read_fast(buf, chunk);
+		update_max_disabled(start);
+		buf += chunk;
+		size -= chunk;
+	}
 }
 
 void spi_write(const uint8_t *buf, unsigned int size)
 {
-	if (current_speed == spiSpeed_Fast)
-		spi_write_fast(buf, size);
-	else
+	unsigned int chunk;
+	uint32_t start;
+
+	if (current_speed != spiSpeed_Fast) {
 		spi_write_slow(buf, size);
+		return;
+	}
+
+	while (size) {
+		chunk = (max_transfer && size > max_transfer) ? max_transfer : size;
+		start = beam_position();
+		if (caps & SPI_CAP_STROBE) {
+			int res = spi_write_strobe(buf, chunk);
+			if (res && strobe_failed(res))
+				continue;
+		} else if (cpu_020)
+			spi_write_fast_020(buf, chunk);
+		else
+			spi_write_fast(buf, chunk);
+		update_max_disabled(start);
+		buf += chunk;
+		size -= chunk;
+	}
+}
+
+extern void spi_read_payload(register uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+extern void spi_write_payload(register const uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+extern void spi_read_payload_020(register uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+extern void spi_write_payload_020(register const uint8_t *buf __asm("a0"), register unsigned int size __asm("d0"));
+
+// READ_SECTORS/WRITE_SECTORS: card address, sector count and flags. Each
+// sector is a frame with a status byte, see avr/main.c. Writes ask for an
+// ACK pulse with every status, the card is busy before most of them.
+void spi_sectors_begin(bool write, uint32_t addr, uint16_t count, uint8_t flags)
+{
+	uint8_t param[7];
+
+	sectors_notify = write && notify_on();
+	if (sectors_notify) {
+		flags |= SECTORS_NOTIFY;
+		notify_begin();
+	}
+
+	param[0] = addr >> 24;
+	param[1] = addr >> 16;
+	param[2] = addr >> 8;
+	param[3] = addr;
+	param[4] = count >> 8;
+	param[5] = count;
+	param[6] = flags;
+
+	spi_ext_begin(write ? EXT_WRITE_SECTORS : EXT_READ_SECTORS, param, sizeof(param));
+}
+
+uint8_t spi_sectors_status(void)
+{
+	bool done = spi_ext_wait(SECTORS_TIMEOUT_MS, sectors_notify);
+
+	if (sectors_notify)
+		notify_end();
+	return done ? *cia_a_prb : 0xff;
+}
+
+// The payload is moved in max_transfer chunks like spi_read(), the adapter
+// waits for the toggles in between.
+void spi_sectors_read(uint8_t *buf)
+{
+	unsigned int size = SPI_SECTOR_SIZE, chunk;
+	uint32_t start;
+
+	while (size) {
+		chunk = (max_transfer && size > max_transfer) ? max_transfer : size;
+		start = beam_position();
+		if (cpu_020)
+			spi_read_payload_020(buf, chunk);
+		else
+			spi_read_payload(buf, chunk);
+		update_max_disabled(start);
+		buf += chunk;
+		size -= chunk;
+	}
+
+	*cia_b_pra ^= CLOCK_MASK;
+}
+
+void spi_sectors_write(const uint8_t *buf)
+{
+	unsigned int size = SPI_SECTOR_SIZE, chunk;
+	uint32_t start;
+
+	*cia_b_pra ^= CLOCK_MASK;
+
+	while (size) {
+		chunk = (max_transfer && size > max_transfer) ? max_transfer : size;
+		start = beam_position();
+		if (cpu_020)
+			spi_write_payload_020(buf, chunk);
+		else
+			spi_write_payload(buf, chunk);
+		update_max_disabled(start);
+		buf += chunk;
+		size -= chunk;
+	}
+}
+
+void spi_sectors_end(void)
+{
+	*cia_b_pra ^= CLOCK_MASK;
 }
@@ -29,6 +29,15 @@ typedef enum {
 	spiSpeed_Slow,
 } spi_speed_t;
 
+/*! Adapter capabilities */
+#define SPI_CAP_STROBE		0x01	/*!< Data bytes clocked by the CIA-A /PC strobe */
+#define SPI_CAP_COMMAND		0x02	/*!< spi_command() */
+#define SPI_CAP_WAIT		0x04	/*!< spi_wait_token(), spi_wait_ready() */
+#define SPI_CAP_SECTORS		0x08	/*!< spi_sectors_*() */
+#define SPI_CAP_BUFFERED	0x10	/*!< SPI_SECTORS_BUFFERED */
+#define SPI_CAP_PREFETCH	0x20	/*!< spi_prefetch() */
+#define SPI_CAP_NOTIFY		0x40	/*!< ACK pulses for spi_set_sleep() */
+
 void spi_init(void);
 void spi_shutdown(void);
 void spi_set_speed(spi_speed_t speed);
@@ -40,4 +49,103 @@ void spi_ext_int_disable(void);
 void spi_read(uint8_t *buf, unsigned int size);
 void spi_write(const uint8_t *buf, unsigned int size);
 
+/*! Bytes in an SD command frame: one byte of clocks and the 6 command bytes */
+#define SPI_COMMAND_FRAME	7
+
+/*! Issues an SD command in a single adapter transaction (SPI_CAP_COMMAND).
+ * Sends the frame, skips one byte if 'skip', polls up to 'polls' (max 15)
+ * bytes for R1 and reads 'extra' (max 7) more bytes. resp receives R1 and
+ * the extra bytes, all 0xff if the adapter did not answer. */
+void spi_command(const uint8_t *frame, bool skip, unsigned int polls,
+		uint8_t *resp, unsigned int extra);
+
+/*! Clocks in bytes on the adapter until one is not 0xff (SPI_CAP_WAIT).
+ * Returns that byte, 0xff on timeout (max 4000 ms). */
+uint8_t spi_wait_token(unsigned int timeout_ms);
+
+/*! Clocks in bytes on the adapter until one is 0xff, the card is no longer
+ * busy (SPI_CAP_WAIT). Returns false on timeout (max 4000 ms). */
+bool spi_wait_ready(unsigned int timeout_ms);
+
+/*! Sector transfers on the adapter (SPI_CAP_SECTORS). spi_sectors_begin()
+ * starts a command for 'count' sectors at card address 'addr', the card
+ * being selected. Each sector starts with spi_sectors_status(), which is
+ * 0xfe before a sector to read with spi_sectors_read() and 0 before a
+ * sector to write with spi_sectors_write(). After the last sector it is 0
+ * for success. Any other status is an error, and spi_sectors_end()
+ * finishes the command after the final or an error status. */
+#define SPI_SECTOR_SIZE		512
+#define SPI_SECTORS_MAX		0xffff	/*!< sectors per command */
+
+#define SPI_SECTORS_OPEN		0x01	/*!< start with CMD17/CMD24, CMD18/CMD25 if MULTI */
+#define SPI_SECTORS_MULTI		0x02	/*!< multiple block transfer */
+#define SPI_SECTORS_CLOSE		0x04	/*!< end it with CMD12/STOP_TRAN, else it is left open */
+#define SPI_SECTORS_PREERASE	0x08	/*!< ACMD23(count) before CMD25 */
+#define SPI_SECTORS_BUFFERED	0x10	/*!< card side runs a sector ahead in the adapter SRAM (SPI_CAP_BUFFERED) */
+
+void spi_sectors_begin(bool write, uint32_t addr, uint16_t count, uint8_t flags);
+uint8_t spi_sectors_status(void);
+void spi_sectors_read(uint8_t *buf);
+void spi_sectors_write(const uint8_t *buf);
+void spi_sectors_end(void);
+
+/*! Read ahead on the adapter (SPI_CAP_PREFETCH). While it is on, a read
+ * transfer left open by spi_sectors_begin() (MULTI without CLOSE) goes on
+ * into the adapter SRAM, up to two sectors. A spi_sectors_begin() without
+ * OPEN continues from there, any other adapter command drops them, so such
+ * a transfer has to be stopped with spi_command(). 'hits' and 'misses'
+ * receive the sectors read ahead that were used and dropped since the last
+ * call. Returns false if the adapter did not answer. */
+#define SPI_PREFETCH_OFF	0
+#define SPI_PREFETCH_ON		1
+#define SPI_PREFETCH_KEEP	2	/*!< only read the counters */
+
+bool spi_prefetch(uint8_t mode, uint16_t *hits, uint16_t *misses);
+
+/*! Asks the adapter firmware for its version and capabilities. Firmware
+ * that does not know the query has none of the SPI_CAP_* features and
+ * version 0. Returns the capabilities. */
+uint8_t spi_probe(void);
+
+/*! Capabilities of the adapter firmware, SPI_CAP_*, from spi_probe() */
+uint8_t spi_get_caps(void);
+/*! Firmware version from spi_probe(), 0 for firmware without the query */
+uint8_t spi_get_version(void);
+/*! Returns true, once, if a strobe transfer lost bytes since the last call.
+ * Strobe mode is then off until the next spi_probe(). */
+bool spi_check_fault(void);
+
+/*! Completion signalling on ACK/CIA-A FLAG (SPI_CAP_NOTIFY). Once a sleep
+ * function is set, spi_wait_token(), spi_wait_ready() and the statuses of
+ * sector writes ask the adapter for an ACK pulse when it drops BUSY, and
+ * call the function while BUSY is high instead of polling. It should return
+ * when the FLAG interrupt has signalled the task, after timeout_ms at most,
+ * or at once if the calling task cannot sleep. NULL to poll again. */
+typedef void (*spi_sleep_t)(unsigned int timeout_ms);
+
+void spi_set_sleep(spi_sleep_t sleep);
+
+/*! Counter of the FLAG interrupts, kept by the caller's interrupt handler.
+ * Pulses are only asked for with both a counter and a sleep function set. */
+void spi_set_flag_count(volatile uint32_t *count);
+
+/*! FLAG interrupts taken for ACK pulses so far: all of those that arrived
+ * while a command that asked for a pulse was running, so that a lost or
+ * an extra pulse does not shift the count. Any other FLAG interrupts are
+ * card detect changes. */
+uint32_t spi_get_notify_count(void);
+
+/*! Limits the bytes moved with interrupts disabled, longer transfers are
+ * split into several adapter commands. 0 (default) for no limit. */
+void spi_set_max_transfer(unsigned int bytes);
+
+/*! Allows strobe mode (SPI_CAP_STROBE) from the next spi_probe() on. It is
+ * off by default: its timing has not been measured on hardware, and a late
+ * strobe can repeat or drop a byte without any error. */
+void spi_set_strobe(bool enable);
+
+/*! Longest time interrupts were disabled by a transfer, measured with the beam counter */
+uint32_t spi_get_max_disabled_us(void);
+void spi_reset_max_disabled(void);
+
 #endif
@@ -0,0 +1,105 @@
+/*
+ * Private commands of spisd.device, shared with the tools that send them
+ */
+
+#ifndef SPISD_H_
+#define SPISD_H_
+
+//#include <stdint.h>
+
+/*!
+ * Private commands, in the range NSD leaves to the device. They are queued
+ * to the unit task, so what they return is consistent with the requests
+ * before them.
+ */
+
+/*!
+ * Copies the time spent per phase of card access into io_Data, an
+ * spisd_profile_t of io_Length bytes (IOERR_BADLENGTH if it is too small).
+ * io_Offset 1 clears the profile after copying it.
+ */
+#define SPISD_CMD_GETPROFILE	0xc000
+
+/*!
+ * Copies the request statistics into io_Data, an spisd_stats_t of io_Length
+ * bytes (IOERR_BADLENGTH if it is too small). io_Offset 1 clears them after
+ * copying them.
+ */
+#define SPISD_CMD_GETSTATS		0xc001
+
+/*!
+ * Copies the trace log into io_Data: an spisd_trace_head_t followed by as
+ * many of the latest spisd_trace_t records as fit in io_Length bytes,
+ * oldest first. io_Offset 1 clears the log after copying it. Only devices
+ * built with TRACE_LOG have it, others answer IOERR_NOCMD.
+ */
+#define SPISD_CMD_GETTRACE		0xc002
+
+/*! Phases of card access in the profile */
+#define SPISD_PHASE_IDLE		0	/*!< waiting for the adapter to finish the previous transaction */
+#define SPISD_PHASE_COMMAND		1	/*!< sending a command and reading its response */
+#define SPISD_PHASE_TOKEN		2	/*!< waiting for the data token of a read */
+#define SPISD_PHASE_BUSY		3	/*!< waiting for the card to be ready, after writes */
+#define SPISD_PHASE_DATA		4	/*!< moving sector data */
+#define SPISD_PHASE_STOP		5	/*!< CMD12 or STOP_TRAN ending a multiple block transfer */
+#define SPISD_PHASES			6
+
+typedef struct {
+	uint32_t	freq;						/*!< timestamp units per second */
+	uint32_t	count[SPISD_PHASES];		/*!< times each phase was entered from another one */
+	uint64_t	time[SPISD_PHASES];			/*!< timestamp units spent in each phase, not counting the phases inside it */
+} spisd_profile_t;
+
+/*! Request types in the statistics */
+#define SPISD_TYPE_READ			0	/*!< CMD_READ */
+#define SPISD_TYPE_WRITE		1	/*!< CMD_WRITE */
+#define SPISD_TYPE_SYNC			2	/*!< CMD_UPDATE, CMD_CLEAR, CMD_RESET, TD_MOTOR, which write out the cache */
+#define SPISD_TYPE_OTHER		3	/*!< commands answered without the card */
+#define SPISD_TYPES				4
+
+/*! Latency histogram buckets, bucket n counts latencies of 2^n up to 2^(n+1) - 1 timestamp units */
+#define SPISD_HIST_BUCKETS		32
+
+typedef struct {
+	uint32_t	requests;
+	uint32_t	sectors;					/*!< sectors asked for by CMD_READ/CMD_WRITE */
+	uint64_t	bytes;						/*!< bytes moved (io_Actual) */
+} spisd_type_stats_t;
+
+typedef struct {
+	uint32_t	freq;						/*!< timestamp units per second, for the histograms */
+	uint32_t	cache_hits;					/*!< CMD_READ requests served by the sector cache */
+	uint32_t	cache_misses;				/*!< CMD_READ requests that went to the card */
+	uint32_t	timeouts;					/*!< requests failed by a timeout of the card */
+	uint32_t	bad_responses;				/*!< requests failed by an unexpected card response */
+	uint32_t	errors;						/*!< requests failed otherwise, such as without a card */
+	spisd_type_stats_t	type[SPISD_TYPES];
+	uint32_t	read_hist[SPISD_HIST_BUCKETS];	/*!< CMD_READ latencies, from the start of its service to its reply */
+	uint32_t	write_hist[SPISD_HIST_BUCKETS];	/*!< CMD_WRITE latencies */
+} spisd_stats_t;
+
+/*! Events in the trace log */
+#define SPISD_EVENT_BEGIN		1	/*!< request arrived, cmd is io_Command */
+#define SPISD_EVENT_REPLY		2	/*!< request done, result is io_Error */
+#define SPISD_EVENT_READ		3	/*!< sectors read from the card, result is an sd_error_t */
+#define SPISD_EVENT_WRITE		4	/*!< sectors written to the card, result is an sd_error_t */
+#define SPISD_EVENT_COMMAND		5	/*!< SD command, cmd is its index (+ 0x80 for ACMD), lba its argument, result R1 */
+#define SPISD_EVENT_STOP		6	/*!< open transfer stopped, cmd is 1 for writes, result is an sd_error_t */
+#define SPISD_EVENT_CARD		7	/*!< card detect change, result is the new disk state */
+
+typedef struct {
+	uint32_t	stamp;						/*!< timestamp, see spisd_trace_head_t freq */
+	uint32_t	lba;						/*!< first sector, or the SD command argument */
+	uint32_t	count;						/*!< sectors */
+	uint16_t	cmd;
+	uint8_t		event;						/*!< SPISD_EVENT_* */
+	uint8_t		result;						/*!< signed, except for the R1 of SPISD_EVENT_COMMAND */
+} spisd_trace_t;
+
+typedef struct {
+	uint32_t	freq;						/*!< timestamp units per second */
+	uint32_t	events;						/*!< events logged since the log was cleared, the oldest may be lost */
+	uint32_t	count;						/*!< records following */
+} spisd_trace_head_t;
+
+#endif /* SPISD_H_ */
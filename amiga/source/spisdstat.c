@@ -0,0 +1,135 @@
+/*
+ * spisdstat - prints the request statistics and the time per phase of card
+ * access of spisd.device
+ *
+ * Usage: spisdstat [reset] [unit]
+ * With reset, the statistics and the profile are cleared after printing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exec/io.h>
+#include <exec/errors.h>
+
+#include <proto/exec.h>
+#include <proto/alib.h>
+
+#include "common.h"
+#include "spisd.h"
+
+static const char * const type_names[SPISD_TYPES] = {
+	"read", "write", "sync", "other"
+};
+
+static const char * const phase_names[SPISD_PHASES] = {
+	"idle", "command", "token", "busy", "data", "stop"
+};
+
+static int get(struct IOStdReq *io, UWORD cmd, void *buf, ULONG size, bool reset)
+{
+	io->io_Command = cmd;
+	io->io_Data = buf;
+	io->io_Length = size;
+	io->io_Offset = reset ? 1 : 0;
+	return DoIO((struct IORequest*)io);
+}
+
+/*! Timestamp units to microseconds */
+static unsigned long to_us(uint64_t t, uint32_t freq)
+{
+	return (unsigned long)(t * 1000000 / freq);
+}
+
+static void print_hist(const char *name, const uint32_t *hist, uint32_t freq)
+{
+	unsigned int n;
+
+	printf("%s latency:\n", name);
+	for (n = 0; n < SPISD_HIST_BUCKETS; n++) {
+		if (hist[n]) {
+			printf("  >= %9lu us %8lu\n", to_us((uint64_t)1 << n, freq), (unsigned long)hist[n]);
+		}
+	}
+}
+
+static void print_stats(const spisd_stats_t *st)
+{
+	unsigned int i;
+
+	printf("%-6s %10s %10s %10s\n", "", "requests", "sectors", "KB");
+	for (i = 0; i < SPISD_TYPES; i++) {
+		printf("%-6s %10lu %10lu %10lu\n", type_names[i], (unsigned long)st->type[i].requests,
+				(unsigned long)st->type[i].sectors, (unsigned long)(st->type[i].bytes >> 10));
+	}
+	printf("cache: %lu hits, %lu misses\n", (unsigned long)st->cache_hits, (unsigned long)st->cache_misses);
+	printf("errors: %lu timeouts, %lu bad responses, %lu other\n",
+			(unsigned long)st->timeouts, (unsigned long)st->bad_responses, (unsigned long)st->errors);
+	print_hist("read", st->read_hist, st->freq);
+	print_hist("write", st->write_hist, st->freq);
+}
+
+static void print_profile(const spisd_profile_t *p)
+{
+	unsigned int i;
+
+	printf("time per phase:\n");
+	for (i = 0; i < SPISD_PHASES; i++) {
+		printf("  %-8s %10lu us %8lu\n", phase_names[i], to_us(p->time[i], p->freq), (unsigned long)p->count[i]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static spisd_stats_t st;
+	static spisd_profile_t prof;
+	struct MsgPort *port;
+	struct IOStdReq *io;
+	ULONG unit = 0;
+	bool reset = false;
+	int i, err, ret = 10;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "reset") == 0 || strcmp(argv[i], "RESET") == 0) {
+			reset = true;
+		} else if (argv[i][0] >= '0' && argv[i][0] <= '9') {
+			unit = strtoul(argv[i], NULL, 0);
+		} else {
+			printf("Usage: %s [reset] [unit]\n", argv[0]);
+			return 5;
+		}
+	}
+
+	port = CreatePort(NULL, 0);
+	if (port == NULL) {
+		return ret;
+	}
+	io = (struct IOStdReq*)CreateExtIO(port, sizeof(struct IOStdReq));
+	if (io == NULL) {
+		DeletePort(port);
+		return ret;
+	}
+	if (OpenDevice((STRPTR)"spisd.device", unit, (struct IORequest*)io, 0) != 0) {
+		printf("Cannot open spisd.device unit %lu\n", (unsigned long)unit);
+	} else {
+		err = get(io, SPISD_CMD_GETSTATS, &st, sizeof(st), reset);
+		if (err == 0) {
+			err = get(io, SPISD_CMD_GETPROFILE, &prof, sizeof(prof), reset);
+		}
+		if (err == IOERR_NOCMD) {
+			printf("spisd.device has no statistics\n");
+		} else if (err != 0) {
+			printf("Error %d\n", err);
+		} else {
+			print_stats(&st);
+			print_profile(&prof);
+			ret = 0;
+		}
+		CloseDevice((struct IORequest*)io);
+	}
+	DeleteExtIO((struct IORequest*)io);
+	DeletePort(port);
+
+	return ret;
+}
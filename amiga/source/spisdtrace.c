@@ -0,0 +1,162 @@
+/*
+ * spisdtrace - dumps and decodes the trace log of spisd.device, built with
+ * TRACE_LOG (Makefile.trace)
+ *
+ * Usage: spisdtrace [clear] [unit]
+ * With clear, the log is cleared after it has been dumped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exec/io.h>
+#include <exec/errors.h>
+#include <exec/memory.h>
+#include <devices/trackdisk.h>
+
+#include <proto/exec.h>
+#include <proto/alib.h>
+
+#include "common.h"
+#include "spisd.h"
+
+/*! Records asked for, more than the device keeps by default */
+#define MAX_RECORDS		4096
+
+static const char *command_name(uint16_t cmd)
+{
+	switch (cmd) {
+		case CMD_RESET:				return "CMD_RESET";
+		case CMD_READ:				return "CMD_READ";
+		case CMD_WRITE:				return "CMD_WRITE";
+		case CMD_UPDATE:			return "CMD_UPDATE";
+		case CMD_CLEAR:				return "CMD_CLEAR";
+		case TD_MOTOR:				return "TD_MOTOR";
+		case TD_FORMAT:				return "TD_FORMAT";
+		case TD_REMOVE:				return "TD_REMOVE";
+		case TD_CHANGENUM:			return "TD_CHANGENUM";
+		case TD_CHANGESTATE:		return "TD_CHANGESTATE";
+		case TD_PROTSTATUS:			return "TD_PROTSTATUS";
+		case TD_GETDRIVETYPE:		return "TD_GETDRIVETYPE";
+		case TD_ADDCHANGEINT:		return "TD_ADDCHANGEINT";
+		case TD_REMCHANGEINT:		return "TD_REMCHANGEINT";
+		case TD_GETGEOMETRY:		return "TD_GETGEOMETRY";
+		case SPISD_CMD_GETPROFILE:	return "GETPROFILE";
+		case SPISD_CMD_GETSTATS:	return "GETSTATS";
+		case SPISD_CMD_GETTRACE:	return "GETTRACE";
+	}
+	return NULL;
+}
+
+static void print_request(const char *event, const spisd_trace_t *t)
+{
+	const char *name = command_name(t->cmd);
+
+	if (name) {
+		printf("%-7s %-15s", event, name);
+	} else {
+		printf("%-7s CMD %-11u", event, (unsigned int)t->cmd);
+	}
+	printf(" sector %lu count %lu", (unsigned long)t->lba, (unsigned long)t->count);
+}
+
+static void print_record(const spisd_trace_t *t)
+{
+	switch (t->event) {
+		case SPISD_EVENT_BEGIN:
+			print_request("begin", t);
+			printf("\n");
+			break;
+		case SPISD_EVENT_REPLY:
+			print_request("reply", t);
+			printf(" error %d\n", (int)(signed char)t->result);
+			break;
+		case SPISD_EVENT_READ:
+		case SPISD_EVENT_WRITE:
+			printf("%-7s sector %lu count %lu result %d\n", t->event == SPISD_EVENT_READ ? "read" : "write",
+					(unsigned long)t->lba, (unsigned long)t->count, (int)(signed char)t->result);
+			break;
+		case SPISD_EVENT_COMMAND:
+			printf("%-7s %sCMD%u arg %08lx R1 %02x\n", "command", (t->cmd & 0x80) ? "A" : "",
+					(unsigned int)(t->cmd & 0x7f), (unsigned long)t->lba, (unsigned int)t->result);
+			break;
+		case SPISD_EVENT_STOP:
+			printf("%-7s %s next sector %lu result %d\n", "stop", t->cmd ? "write" : "read",
+					(unsigned long)t->lba, (int)(signed char)t->result);
+			break;
+		case SPISD_EVENT_CARD:
+			printf("%-7s state %u\n", "card", (unsigned int)t->result);
+			break;
+		default:
+			printf("event %u\n", (unsigned int)t->event);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	ULONG size = sizeof(spisd_trace_head_t) + MAX_RECORDS * sizeof(spisd_trace_t);
+	struct MsgPort *port;
+	struct IOStdReq *io;
+	spisd_trace_head_t *head;
+	spisd_trace_t *rec;
+	ULONG unit = 0;
+	bool clear = false;
+	uint32_t i;
+	int a, err, ret = 10;
+
+	for (a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "clear") == 0 || strcmp(argv[a], "CLEAR") == 0) {
+			clear = true;
+		} else if (argv[a][0] >= '0' && argv[a][0] <= '9') {
+			unit = strtoul(argv[a], NULL, 0);
+		} else {
+			printf("Usage: %s [clear] [unit]\n", argv[0]);
+			return 5;
+		}
+	}
+
+	head = AllocMem(size, MEMF_PUBLIC);
+	if (head == NULL) {
+		printf("Out of memory\n");
+		return ret;
+	}
+	rec = (spisd_trace_t*)(head + 1);
+
+	port = CreatePort(NULL, 0);
+	io = port ? (struct IOStdReq*)CreateExtIO(port, sizeof(struct IOStdReq)) : NULL;
+	if (io == NULL) {
+		printf("Out of memory\n");
+	} else if (OpenDevice((STRPTR)"spisd.device", unit, (struct IORequest*)io, 0) != 0) {
+		printf("Cannot open spisd.device unit %lu\n", (unsigned long)unit);
+	} else {
+		io->io_Command = SPISD_CMD_GETTRACE;
+		io->io_Data = head;
+		io->io_Length = size;
+		io->io_Offset = clear ? 1 : 0;
+		err = DoIO((struct IORequest*)io);
+		if (err == IOERR_NOCMD) {
+			printf("spisd.device was built without TRACE_LOG\n");
+		} else if (err != 0) {
+			printf("Error %d\n", err);
+		} else {
+			printf("%lu events, the last %lu follow, times in us\n",
+					(unsigned long)head->events, (unsigned long)head->count);
+			for (i = 0; i < head->count; i++) {
+				printf("%10lu ", (unsigned long)((uint64_t)(rec[i].stamp - rec[0].stamp) * 1000000 / head->freq));
+				print_record(&rec[i]);
+			}
+			ret = 0;
+		}
+		CloseDevice((struct IORequest*)io);
+	}
+	if (io) {
+		DeleteExtIO((struct IORequest*)io);
+	}
+	if (port) {
+		DeletePort(port);
+	}
+	FreeMem(head, size);
+
+	return ret;
+}
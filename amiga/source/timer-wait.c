@@ -0,0 +1,60 @@
+/*
+ * Waits that yield the CPU, shared by the Amiga and host builds
+ */
+
+#include "common.h"
+#include "timer.h"
+
+/* Spin window in beam counter colour clocks */
+#define SPIN_CC		((TIMER_SPIN_US * 1000ul) / TIMER_CC_NS)
+
+static timer_sleep_t sleep_fn;
+
+void timer_set_sleep(timer_sleep_t sleep)
+{
+	sleep_fn = sleep;
+}
+
+void timer_wait_begin(timer_wait_t *w)
+{
+	w->start = timer_get_tick_count();
+	w->start_cc = timer_get_beam();
+	w->sleep_ms = 0;
+}
+
+uint32_t timer_wait_poll(timer_wait_t *w)
+{
+	uint32_t now = timer_get_tick_count();
+	int32_t cc;
+
+	if (sleep_fn == NULL) {
+		return now;
+	}
+	if (w->sleep_ms == 0) {
+		/* The tick counter advances as the beam counter starts a new frame */
+		cc = (int32_t)((now - w->start) * timer_get_frame_cc() + timer_get_beam() - w->start_cc);
+		if (cc < (int32_t)SPIN_CC) {
+			return now;
+		}
+		w->sleep_ms = 1;
+	}
+	if (sleep_fn(w->sleep_ms)) {
+		if (w->sleep_ms < TIMER_SLEEP_MAX_MS) {
+			w->sleep_ms <<= 1;
+		}
+		now = timer_get_tick_count();
+	}
+	return now;
+}
+
+void timer_delay(uint32_t ticks)
+{
+	timer_wait_t w;
+	uint32_t timeout;
+
+	timer_wait_begin(&w);
+	timeout = w.start + ticks;
+	while ((int32_t)(timer_wait_poll(&w) - timeout) < 0) {
+
+	}
+}
@@ -19,13 +19,29 @@
 
 //#include <stdint.h>
 
+#include <exec/execbase.h>
+#include <devices/timer.h>
+
+#include <proto/timer.h>
+
 #include "common.h"
 #include "timer.h"
 
+#define BEAM_LINE_CC	227
+
 static volatile uint8_t * const todl = (volatile uint8_t*)0xbfe801;
 static volatile uint8_t * const todm = (volatile uint8_t*)0xbfe901;
 static volatile uint8_t * const todh = (volatile uint8_t*)0xbfea01;
 
+/* VPOSR/VHPOSR, beam position in lines and colour clocks */
+static volatile uint32_t * const beam = (volatile uint32_t*)0xdff004;
+
+static uint32_t frame_cc;
+
+/* Set for timer.device V36+, which has ReadEClock() */
+struct Device *TimerBase = NULL;
+static uint32_t eclock_freq;
+
 uint32_t timer_get_tick_count(void)
 {
 	uint8_t l,m,h;
@@ -37,10 +53,48 @@ uint32_t timer_get_tick_count(void)
 	return ((uint32_t)h << 16) | ((uint32_t)m << 8) | (uint32_t)l;
 }
 
-void timer_delay(uint32_t ticks)
+uint32_t timer_get_beam(void)
 {
-	uint32_t timeout = timer_get_tick_count() + ticks;
-	while ((int32_t)(timer_get_tick_count() - timeout) < 0) {
+	uint32_t v = *beam;
 
+	return ((v >> 8) & 0x1ff) * BEAM_LINE_CC + (v & 0xff);
+}
+
+uint32_t timer_get_frame_cc(void)
+{
+	struct ExecBase *sys;
+
+	if (frame_cc == 0) {
+		sys = *(struct ExecBase **)4;
+		frame_cc = (sys->VBlankFrequency == 50 ? 313 : 263) * BEAM_LINE_CC;
 	}
+	return frame_cc;
+}
+
+void timer_set_device(struct Device *device)
+{
+	struct EClockVal ev;
+
+	if (device && device->dd_Library.lib_Version >= 36) {
+		TimerBase = device;
+		eclock_freq = ReadEClock(&ev);
+	} else {
+		TimerBase = NULL;
+	}
+}
+
+uint32_t timer_get_stamp(void)
+{
+	struct EClockVal ev;
+
+	if (TimerBase) {
+		ReadEClock(&ev);
+		return ev.ev_lo;
+	}
+	return timer_get_tick_count();
+}
+
+uint32_t timer_get_stamp_freq(void)
+{
+	return TimerBase ? eclock_freq : TIMER_TICK_FREQ;
 }
@@ -46,6 +46,75 @@
  * \return				Current tick count
  */
 uint32_t timer_get_tick_count(void);
+
+/*! Beam counter colour clock in ns (279.4 NTSC, 281.9 PAL) */
+#define TIMER_CC_NS				280
+
+/*!
+ * Returns the beam position in colour clocks since the start of the frame.
+ * The tick counter advances as a new frame starts, so ticks and beam
+ * position together measure short times.
+ */
+uint32_t timer_get_beam(void);
+
+/*! Colour clocks per frame, one tick */
+uint32_t timer_get_frame_cc(void);
+
+struct Device;
+
+/*!
+ * Sets timer.device, opened by the caller, as the source of timestamps.
+ * From V36 on timer_get_stamp() reads the E-clock (about 1.4 us), before
+ * that or with NULL it only has the tick counter.
+ */
+void timer_set_device(struct Device *device);
+
+/*!
+ * Returns a free running timestamp for profiling. It wraps around, only
+ * the difference of two timestamps is meaningful.
+ */
+uint32_t timer_get_stamp(void);
+
+/*! Timestamp units per second */
+uint32_t timer_get_stamp_freq(void);
+
+/*! Waits for 'ticks', yielding the CPU like timer_wait_poll() */
 void timer_delay(uint32_t ticks);
 
+#ifndef TIMER_SPIN_US
+/*! Time a wait polls before it starts to sleep between the polls */
+#define TIMER_SPIN_US			2000
+#endif
+
+/*! Longest sleep between two polls, the sleeps double up to this */
+#define TIMER_SLEEP_MAX_MS		8
+
+/*!
+ * Puts the calling task to sleep for about 'ms'. Returns false at once if
+ * the task cannot sleep, the wait then goes on polling.
+ */
+typedef bool (*timer_sleep_t)(unsigned int ms);
+
+/*! Sets the sleep function of long waits, NULL for busy waits only */
+void timer_set_sleep(timer_sleep_t sleep);
+
+/*! State of a wait that polls */
+typedef struct {
+	uint32_t		start;		/*!< tick count at timer_wait_begin() */
+	uint32_t		start_cc;	/*!< timer_get_beam() at timer_wait_begin() */
+	unsigned int	sleep_ms;	/*!< next sleep, 0 while spinning */
+} timer_wait_t;
+
+void timer_wait_begin(timer_wait_t *w);
+
+/*!
+ * Called between two polls of a wait. Spins for TIMER_SPIN_US, measured
+ * with the beam counter, then sleeps 1, 2, 4 ms and so on up to
+ * TIMER_SLEEP_MAX_MS before each poll, so that other tasks get the CPU
+ * while the card works.
+ *
+ * \return				Current tick count, for the timeout check
+ */
+uint32_t timer_wait_poll(timer_wait_t *w);
+
 #endif /* TIMER_H_ */
@@ -0,0 +1,55 @@
+/*
+ * Binary trace log, built with TRACE_LOG (Makefile.trace)
+ */
+
+#include <proto/exec.h>
+
+#include "common.h"
+#include "timer.h"
+#include "trace.h"
+
+static spisd_trace_t trace_log[TRACE_LOG_SIZE];
+static uint32_t events;
+
+void trace_event(uint8_t event, uint16_t cmd, uint32_t lba, uint32_t count, int result)
+{
+	spisd_trace_t *t;
+
+	/* Requests arrive in the tasks of the callers */
+	Forbid();
+	t = &trace_log[events++ & (TRACE_LOG_SIZE - 1)];
+	t->stamp = timer_get_stamp();
+	t->lba = lba;
+	t->count = count;
+	t->cmd = cmd;
+	t->event = event;
+	t->result = (uint8_t)result;
+	Permit();
+}
+
+unsigned int trace_get(spisd_trace_head_t *head, spisd_trace_t *buf, unsigned int max)
+{
+	unsigned int n, i;
+
+	Forbid();
+	n = events < TRACE_LOG_SIZE ? events : TRACE_LOG_SIZE;
+	if (n > max) {
+		n = max;
+	}
+	for (i = 0; i < n; i++) {
+		buf[i] = trace_log[(events - n + i) & (TRACE_LOG_SIZE - 1)];
+	}
+	head->freq = timer_get_stamp_freq();
+	head->events = events;
+	head->count = n;
+	Permit();
+
+	return n;
+}
+
+void trace_clear(void)
+{
+	Forbid();
+	events = 0;
+	Permit();
+}
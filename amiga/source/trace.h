@@ -0,0 +1,39 @@
+/*
+ * Binary trace log of requests and card commands, kept in memory so that
+ * tracing does not slow the driver down like kprintf() does
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "spisd.h"
+
+#ifndef TRACE_LOG_SIZE
+/*! Records kept in the ring buffer, a power of two */
+#define TRACE_LOG_SIZE			1024
+#endif
+
+#if TRACE_LOG
+
+/*! Logs an event, from any task but not from interrupts */
+void trace_event(uint8_t event, uint16_t cmd, uint32_t lba, uint32_t count, int result);
+
+/*!
+ * Copies up to 'max' of the latest records into 'buf', oldest first, and
+ * fills in 'head'.
+ *
+ * \return				Number of records copied
+ */
+unsigned int trace_get(spisd_trace_head_t *head, spisd_trace_t *buf, unsigned int max);
+
+void trace_clear(void);
+
+#define TRACE_EVENT(event, cmd, lba, count, result)		trace_event(event, cmd, lba, count, result)
+
+#else
+
+#define TRACE_EVENT(...)
+
+#endif
+
+#endif /* TRACE_H_ */
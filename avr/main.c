@@ -15,17 +15,21 @@
 // D6          D6          BOTH             PD6
 // D7          D7          BOTH             PD7
 
-// BUSY/IDLE   D4          OUTPUT           PD4
+// BUSY/IDLE   D4          OUTPUT           PD4                                       (D3/PD3 in USART_MODE builds)
 // POUT/CLOCK  D5          INPUT            PD5
 
 // SEL         --          --               --           CS
-// STROBE      --          --               --           --      
+// STROBE      D2          INPUT            PD2          --           (STROBE_MODE builds only)
 
 //             D10         OUTPUT           PB2          SS'         CD/DAT3
 //             D11         OUTPUT           PB3          MOSI        CMD
 //             D12         INPUT            PB4          MISO        DAT0
 //             D13         OUTPUT           PB5          SCK         CLK
 
+//             D1          OUTPUT           PD1          TXD0        CMD       (USART_MODE builds only)
+//             D0          INPUT            PD0          RXD0        DAT0      (USART_MODE builds only)
+//             D4          OUTPUT           PD4          XCK0        CLK       (USART_MODE builds only)
+
 // CD'         D8          INPUT_PULLUP     PB0 ---|
 // ACK         D9          OUTPUT           PB1 <--|
 
@@ -47,9 +51,712 @@
 #define ACK_BIT     1                                                           // Propagates CD' state to Amiga via Parallel port
 
 // Port D: Parallel Port Control Lines
+#define STROBE_BIT  2                                                           // INT0, only used by STROBE_MODE builds
+#ifdef USART_MODE
+#define IDLE_BIT    3
+#define XCK_BIT     4                                                           // USART clock, SCK of the card
+#else
 #define IDLE_BIT    4
+#endif
 #define CLOCK_BIT   5
 
+// STROBE_MODE: the Amiga's STROBE line (parallel port pin 1, CIA-A /PC) is wired to D2.
+// CIA-A pulses it low on every access to the data port, so after a STROBE_WRITE/STROBE_READ
+// command each data byte is clocked by the strobe instead of a POUT toggle. INT0 is set up
+// for falling edges but not enabled, the INTF0 flag is polled. A strobe that does not come
+// within about 30 ms (65536 polls of about 8 cycles) ends the transfer and BUSY drops, so a
+// lost or merged strobe cannot hang the AVR. The driver sees BUSY still high after its last
+// byte and stops using strobe mode.
+#define STROBE_WAIT(timeout)    do { uint16_t n = 0; while (!(EIFR & (1 << INTF0))) if (!--n) goto timeout; } while (0)
+
+// USART_MODE: the card is driven by USART0 in master SPI mode (MSPIM) instead of the SPI.
+// Its transmitter is double buffered, so the write paths queue the next byte while the
+// current one is shifted out and the bytes go back to back. The received bytes of a write
+// are dropped afterwards by usart_flush(). Everything else keeps one byte in flight, as with
+// the SPI, because the receiver would overrun at fosc/2.
+#ifdef USART_MODE
+#define SPI_DATA        UDR0
+#define SPI_DONE()      (UCSR0A & (1 << RXC0))
+// TXC0 is cleared and UDR0 written with interrupts off. If PCINT0_vect ran in between, the
+// byte before could finish and set TXC0 again, and usart_flush() would return too early.
+#define SPI_QUEUE(b)    do { uint8_t q = (b); while (!(UCSR0A & (1 << UDRE0))); cli(); UCSR0A = (1 << TXC0); UDR0 = q; sei(); } while (0)
+#define SPI_FAST()      (UBRR0 = 0)                                             // fosc/2 = 8 MHz
+#define SPI_SLOW()      (UBRR0 = 31)                                            // fosc/64 = 250 kHz
+#define DDRD_SPI        (1 << XCK_BIT)
+#else
+#define SPI_DATA        SPDR
+#define SPI_DONE()      (SPSR & (1 << SPIF))
+#define SPI_FAST()      (SPCR = (1 << SPE) | (1 << MSTR))
+#define SPI_SLOW()      (SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0))
+#define DDRD_SPI        0
+#endif
+
+// Extended commands, 11xxxxxx with these low six bits (00000x selects the SPI speed)
+#define OP_STROBE_WRITE 0x02                                                    // STROBE_MODE builds only
+#define OP_STROBE_READ  0x03
+#define OP_COMMAND      0x04
+#define OP_WAIT_TOKEN   0x05
+#define OP_WAIT_READY   0x06
+#define OP_READ_SECTORS 0x07
+#define OP_WRITE_SECTORS 0x08
+#define OP_PREFETCH     0x09
+#define OP_QUERY        0x0a
+
+// QUERY reply: magic, version and capabilities, the SPI_CAP_* bits of spi-par.h
+#define QUERY_MAGIC     0x53
+#define FIRMWARE_VERSION 2
+#define CAP_STROBE      0x01
+#define CAP_COMMAND     0x02
+#define CAP_WAIT        0x04
+#define CAP_SECTORS     0x08
+#define CAP_BUFFERED    0x10
+#define CAP_PREFETCH    0x20
+#define CAP_NOTIFY      0x40
+#ifdef STROBE_MODE
+#define FIRMWARE_CAPS   (CAP_STROBE | CAP_COMMAND | CAP_WAIT | CAP_SECTORS | CAP_BUFFERED | CAP_PREFETCH | CAP_NOTIFY)
+#else
+#define FIRMWARE_CAPS   (CAP_COMMAND | CAP_WAIT | CAP_SECTORS | CAP_BUFFERED | CAP_PREFETCH | CAP_NOTIFY)
+#endif
+
+// Timer 1 runs free at fosc/1024 as a time base for the timeouts
+#define TICKS_PER_MS    16                                                      // 15.625
+#define MAX_TIMEOUT_MS  4000
+#define CARD_TIMEOUT_MS 500                                                     // Data token or busy, READ_SECTORS/WRITE_SECTORS
+#define WAIT_NOTIFY     0x80                                                    // In the high timeout byte of WAIT_TOKEN/WAIT_READY
+
+// SD commands issued by READ_SECTORS/WRITE_SECTORS
+#define CMD12           12
+#define CMD17           17
+#define CMD18           18
+#define CMD23           23
+#define CMD24           24
+#define CMD25           25
+#define CMD55           55
+#define MAX_RESPONSE_POLLS 10
+
+// Extended commands: the parameters follow the opcode, one per POUT edge. BUSY/IDLE goes high
+// as soon as the opcode is seen and the AVR works on its own. BUSY drops with the first reply
+// byte on the data pins, the next reply bytes follow one per POUT edge, and one more edge ends
+// the command.
+#define EXT_BUF_SIZE    16
+
+static uint8_t ext_buf[EXT_BUF_SIZE];
+
+// Set while a command asked for an ACK pulse with each drop of BUSY (NOTIFY). The Amiga then sleeps
+// until its CIA-A FLAG interrupt instead of polling BUSY. The Amiga counts the pulses it asked for,
+// the other FLAG interrupts are card detect changes.
+static uint8_t notify;
+
+static uint8_t spi_xfer(uint8_t out) {
+    SPI_DATA = out;
+    while (!SPI_DONE());
+    return SPI_DATA;
+}
+
+#ifdef USART_MODE
+// Waits until the bytes queued by SPI_QUEUE are out and drops the bytes received meanwhile.
+// TXC0 is cleared with every queued byte, so it is only set once the last one is shifted out.
+static void usart_flush(void) {
+    while (!(UCSR0A & (1 << TXC0)));
+    while (UCSR0A & (1 << RXC0))
+        (void) UDR0;
+}
+#endif
+
+// Waits for the next POUT edge, clock is the level after the previous one
+static uint8_t wait_clock(uint8_t clock) {
+    if (clock)
+        while (PIND & (1 << CLOCK_BIT));
+    else
+        while (!(PIND & (1 << CLOCK_BIT)));
+    return PIND & (1 << CLOCK_BIT);
+}
+
+static uint8_t ext_receive(uint8_t clock, uint8_t n) {
+    uint8_t i;
+
+    for (i = 0; i < n; i++) {
+        clock = wait_clock(clock);
+        ext_buf[i] = (PIND & 0b11000000) | PINC;
+    }
+    return clock;
+}
+
+// Inverts ACK for about 1 us. Whatever the card detect level, FLAG sees one falling edge.
+static void ack_pulse(void) {
+    cli();                                                                      // Keep PCINT0_vect from changing ACK meanwhile
+    PINB = (1 << ACK_BIT);                                                      // Writing PINB toggles PORTB
+    __builtin_avr_delay_cycles(16);
+    PINB = (1 << ACK_BIT);
+    sei();
+}
+
+// Puts a byte on the data pins and drops BUSY
+static void ext_frame(uint8_t b) {
+    if (notify)
+        ack_pulse();
+
+    PORTC = b;                                                                  // Data before BUSY drops
+    DDRC = 0b00111111;
+    DDRD = DDRD_SPI | 0b11000000 | (1 << IDLE_BIT);
+    PORTD = b & 0b11000000;
+}
+
+// Releases the data pins and raises BUSY
+static void ext_release(void) {
+    DDRD = DDRD_SPI | (1 << IDLE_BIT);
+    DDRC = 0;
+
+    PORTD = (1 << IDLE_BIT);
+    PORTC = 0;
+}
+
+static void ext_reply(uint8_t clock, uint8_t n) {
+    uint8_t i;
+
+    ext_frame(ext_buf[0]);
+
+    for (i = 1; i < n; i++) {
+        clock = wait_clock(clock);
+        PORTC = ext_buf[i];
+        PORTD = ext_buf[i] & 0b11000000;
+    }
+    wait_clock(clock);
+
+    DDRD = DDRD_SPI | (1 << IDLE_BIT);
+    DDRC = 0;
+
+    PORTD = 0;
+    PORTC = 0;
+}
+
+// COMMAND: parameter byte (polls << 4 | skip << 3 | extra) and the 7 byte command frame.
+// Replies with R1, the first byte without bit 7 within polls bytes, followed by extra bytes.
+static void ext_command(uint8_t clock) {
+    uint8_t param, polls, r1, i;
+
+    clock = ext_receive(clock, 8);
+    param = ext_buf[0];
+
+    for (i = 1; i < 8; i++)
+        spi_xfer(ext_buf[i]);
+    if (param & 0x08)
+        spi_xfer(0xff);
+
+    polls = param >> 4;
+    do {
+        r1 = spi_xfer(0xff);
+    } while ((r1 & 0x80) && --polls);
+
+    ext_buf[0] = r1;
+    for (i = 1; i <= (param & 0x07); i++)
+        ext_buf[i] = spi_xfer(0xff);
+
+    ext_reply(clock, 1 + (param & 0x07));
+}
+
+// Clocks in bytes until one is not 0xff (a data token) or is 0xff (card not busy), or until
+// ms have passed. Returns the last byte.
+static uint8_t spi_wait(uint8_t ready, uint16_t ms) {
+    uint16_t start, limit;
+    uint8_t in;
+
+    limit = (ms > MAX_TIMEOUT_MS ? MAX_TIMEOUT_MS : ms) * TICKS_PER_MS;
+
+    start = TCNT1;
+    do {
+        in = spi_xfer(0xff);
+        if ((in == 0xff) == ready)
+            break;
+    } while ((uint16_t)(TCNT1 - start) < limit);
+
+    return in;
+}
+
+// WAIT_TOKEN/WAIT_READY: timeout in ms as two bytes (high, low), WAIT_NOTIFY in the high byte
+// for an ACK pulse with the reply. Clocks in bytes at full SPI speed until one is not 0xff (a data
+// token) or is 0xff (card not busy). WAIT_TOKEN replies with the last byte, 0xff on timeout.
+// WAIT_READY replies with 0 when ready and 1 on timeout.
+static void ext_wait(uint8_t clock, uint8_t ready) {
+    uint8_t in;
+
+    clock = ext_receive(clock, 2);
+    notify = ext_buf[0] & WAIT_NOTIFY;
+    in = spi_wait(ready, ((ext_buf[0] & ~WAIT_NOTIFY) << 8) | ext_buf[1]);
+
+    if (ready)
+        ext_buf[0] = (in == 0xff) ? 0 : 1;
+    else
+        ext_buf[0] = in;
+    ext_reply(clock, 1);
+    notify = 0;
+}
+
+// Sends an SD command with a dummy CRC, preceded by one byte of clocks, and returns R1.
+// CMD12 is followed by a stuff byte before R1.
+static uint8_t sd_command(uint8_t cmd, uint32_t arg) {
+    uint8_t polls = MAX_RESPONSE_POLLS;
+    uint8_t r1;
+
+    spi_xfer(0xff);
+    spi_xfer(0x40 | cmd);
+    spi_xfer(arg >> 24);
+    spi_xfer(arg >> 16);
+    spi_xfer(arg >> 8);
+    spi_xfer(arg);
+    spi_xfer(0x01);
+    if (cmd == CMD12)
+        spi_xfer(0xff);
+
+    do {
+        r1 = spi_xfer(0xff);
+    } while ((r1 & 0x80) && --polls);
+
+    return r1;
+}
+
+// READ_SECTORS/WRITE_SECTORS: card address (4 bytes), sector count (2 bytes), both most
+// significant first, and a flags byte. The Amiga selects the card before.
+#define SECTORS_OPEN     0x01                                                   // Send CMD17/CMD24, or CMD18/CMD25 if MULTI
+#define SECTORS_MULTI    0x02                                                   // Multiple block transfer
+#define SECTORS_CLOSE    0x04                                                   // CMD12/STOP_TRAN after the last block
+#define SECTORS_PREERASE 0x08                                                   // ACMD23(count) before CMD25
+#define SECTORS_BUFFERED 0x10                                                   // Double buffered multiple block transfer
+#define SECTORS_NOTIFY   0x20                                                   // ACK pulse with every status
+//
+// Every sector is a frame: a status byte on the data pins with BUSY low. For reads the status is
+// the data token 0xfe and the 512 data bytes follow one per POUT edge, like READ, with BUSY high.
+// For writes the status is 0, one POUT edge releases the data pins, and the 512 data bytes follow
+// one per edge, like WRITE. Any other status is an error and ends the command like a reply.
+// After the last sector a final status (0 for success) ends the command like a reply. Without
+// CLOSE a multiple block transfer is left open, to be continued without OPEN or ended with
+// CMD12/STOP_TRAN through COMMAND.
+//
+// BUFFERED: the sectors go through two buffers in SRAM. While the Amiga reads one buffer over
+// the port, the next sector is read from the card into the other; while it writes one, the
+// previous sector is written from the other to the card. The card side is a job that is advanced
+// by one SPI byte after every port byte, in the time until the next POUT edge, so the card access
+// time overlaps with the port transfer instead of adding to it.
+//
+// PREFETCH: when a read transfer is left open (MULTI without CLOSE), the AVR goes on reading up
+// to two sectors ahead into the buffers after the command, with BUSY high. The POUT edge of the
+// Amiga waiting for BUSY to drop pauses the card job between two bytes. A READ_SECTORS without
+// OPEN continues the transfer from the sectors read ahead, any other command drops them (the
+// Amiga ends the transfer with CMD12 through COMMAND).
+#define CARD_DONE       0
+#define CARD_TOKEN      1                                                       // Read: waiting for the data token
+#define CARD_IN         2                                                       // Read: data bytes
+#define CARD_CRC        3                                                       // Read: CRC bytes
+#define CARD_READY      4                                                       // Write: waiting for the card to be ready
+#define CARD_OUT        5                                                       // Write: token, data and CRC bytes
+#define CARD_RESP       6                                                       // Write: data response
+
+static uint8_t sector_buf[2][512];
+
+static struct {
+    uint8_t state;
+    uint8_t status;                                                             // Read: 0xfe or the error, write: 0 or the error
+    uint8_t token;
+    uint8_t *p;
+    uint16_t n;
+    uint16_t start;
+    uint8_t paused;                                                             // Byte received into in, not yet stepped
+    uint8_t in;
+} card;
+
+// Sectors read ahead into sector_buf, in order from head
+static struct {
+    uint8_t head;
+    uint8_t ready;                                                              // Complete sectors
+    uint8_t job;                                                                // The card job reads the one after them
+    uint8_t error;                                                              // Status of a failed read ahead
+    uint8_t prefetched;                                                         // Ready or started before this command
+} ring;
+
+static uint8_t prefetch;                                                        // PREFETCH on
+static uint16_t prefetch_hits;
+static uint16_t prefetch_misses;
+
+// Advances the card job with the byte received by the SPI transfer it started
+static void card_step(uint8_t in) {
+    switch (card.state) {
+    case CARD_TOKEN:
+        if (in == 0xfe) {
+            card.state = CARD_IN;
+            card.n = 512;
+        } else if (in != 0xff || (uint16_t)(TCNT1 - card.start) >= CARD_TIMEOUT_MS * TICKS_PER_MS) {
+            card.status = in;
+            card.state = CARD_DONE;
+            return;
+        }
+        SPI_DATA = 0xff;
+        break;
+    case CARD_IN:
+        *card.p++ = in;
+        if (--card.n == 0) {
+            card.state = CARD_CRC;
+            card.n = 2;
+        }
+        SPI_DATA = 0xff;
+        break;
+    case CARD_CRC:
+        if (--card.n == 0) {
+            card.status = 0xfe;
+            card.state = CARD_DONE;
+            return;
+        }
+        SPI_DATA = 0xff;
+        break;
+    case CARD_READY:
+        if (in == 0xff) {
+            card.state = CARD_OUT;
+            card.n = 512 + 2;
+            SPI_DATA = card.token;
+        } else if ((uint16_t)(TCNT1 - card.start) >= CARD_TIMEOUT_MS * TICKS_PER_MS) {
+            card.status = 0xff;
+            card.state = CARD_DONE;
+        } else {
+            SPI_DATA = 0xff;
+        }
+        break;
+    case CARD_OUT:
+        if (card.n) {
+            SPI_DATA = card.n > 2 ? *card.p++ : 0xff;                           // Data, then dummy CRC
+            card.n--;
+        } else {
+            card.state = CARD_RESP;
+            SPI_DATA = 0xff;
+        }
+        break;
+    case CARD_RESP:
+        card.status = ((in & 0x1f) == 0x05) ? 0 : in;
+        card.state = CARD_DONE;
+        break;
+    }
+}
+
+static void card_start(uint8_t state, uint8_t *p) {
+    card.state = state;
+    card.p = p;
+    card.start = TCNT1;
+    SPI_DATA = 0xff;
+}
+
+static void card_finish(void) {
+    while (card.state != CARD_DONE) {
+        while (!SPI_DONE());
+        card_step(SPI_DATA);
+    }
+}
+
+// Stops the card job after the byte in flight, leaving the SPI free
+static void card_pause(void) {
+    if (card.state != CARD_DONE && !card.paused) {
+        while (!SPI_DONE());
+        card.in = SPI_DATA;
+        card.paused = 1;
+        card.start = TCNT1 - card.start;                                        // Keeps the time run so far
+    }
+}
+
+static void card_resume(void) {
+    if (card.paused) {
+        card.paused = 0;
+        card.start = TCNT1 - card.start;                                        // The pause does not count against the timeout, the time before it does
+        card_step(card.in);
+    }
+}
+
+// Takes the sector of a finished card job into the ring
+static void ring_collect(void) {
+    if (ring.job && card.state == CARD_DONE) {
+        ring.job = 0;
+        if (card.status == 0xfe)
+            ring.ready++;
+        else
+            ring.error = card.status;
+    }
+}
+
+// Starts reading the next sector into the free buffer, if more are wanted
+static void ring_fill(uint8_t more) {
+    if (more && !ring.job && !ring.error && ring.ready < 2) {
+        card_start(CARD_TOKEN, sector_buf[(ring.head + ring.ready) & 1]);
+        ring.job = 1;
+    }
+}
+
+// Forgets the sectors read ahead. A card job is left where it was paused, inside a block.
+static void ring_drop(void) {
+    prefetch_misses += ring.ready + ring.job;
+    ring.ready = 0;
+    ring.job = 0;
+    ring.error = 0;
+    ring.prefetched = 0;
+    card.state = CARD_DONE;
+    card.paused = 0;
+}
+
+// Reads ahead with BUSY high until both buffers are full or the next POUT edge, which only
+// pauses the card job
+static void prefetch_idle(void) {
+    uint8_t clock = PIND & (1 << CLOCK_BIT);
+
+    PORTD = (1 << IDLE_BIT);
+    card_resume();
+
+    while ((PIND & (1 << CLOCK_BIT)) == clock && ring.job) {
+        if (card.state == CARD_DONE) {
+            ring_collect();
+            ring_fill(1);
+        } else if (SPI_DONE()) {
+            card_step(SPI_DATA);
+        }
+    }
+    card_pause();
+
+    PORTD = 0;
+}
+
+static uint8_t ext_read_buffer(uint8_t clock, const uint8_t *p) {
+    uint16_t n;
+
+    ext_frame(0xfe);
+
+    for (n = 0; n < 512; n++) {
+        clock = wait_clock(clock);
+        PORTC = *p;
+        PORTD = (*p++ & 0b11000000) | (1 << IDLE_BIT);
+        if (card.state != CARD_DONE && SPI_DONE())
+            card_step(SPI_DATA);
+    }
+    clock = wait_clock(clock);
+
+    ext_release();
+
+    return clock;
+}
+
+static uint8_t ext_write_buffer(uint8_t clock, uint8_t *p) {
+    uint16_t n;
+
+    ext_frame(0);
+    clock = wait_clock(clock);
+    ext_release();
+
+    for (n = 0; n < 512; n++) {
+        clock = wait_clock(clock);
+        *p++ = (PIND & 0b11000000) | PINC;
+        if (card.state != CARD_DONE && SPI_DONE())
+            card_step(SPI_DATA);
+    }
+
+    return clock;
+}
+
+static uint8_t ext_read_block(uint8_t clock) {
+    uint16_t n;
+    uint8_t next;
+
+    SPI_DATA = 0xff;
+    ext_frame(0xfe);
+
+    for (n = 0; n < 512; n++) {
+        while (!SPI_DONE());
+        next = SPI_DATA;
+        clock = wait_clock(clock);
+        PORTC = next;
+        PORTD = (next & 0b11000000) | (1 << IDLE_BIT);
+        SPI_DATA = 0xff;                                                        // The last one is the first CRC byte
+    }
+    while (!SPI_DONE());
+    (void) SPI_DATA;
+    clock = wait_clock(clock);
+
+    ext_release();
+    spi_xfer(0xff);                                                             // Second CRC byte
+
+    return clock;
+}
+
+static uint8_t ext_write_block(uint8_t clock, uint8_t token) {
+    uint16_t n;
+
+    spi_xfer(token);
+
+    ext_frame(0);
+    clock = wait_clock(clock);
+    ext_release();
+
+    for (n = 0; n < 512; n++) {
+        clock = wait_clock(clock);
+#ifdef USART_MODE
+        SPI_QUEUE((PIND & 0b11000000) | PINC);
+    }
+    usart_flush();
+#else
+        SPI_DATA = (PIND & 0b11000000) | PINC;
+        while (!SPI_DONE());
+    }
+#endif
+    spi_xfer(0xff);                                                             // Dummy CRC
+    spi_xfer(0xff);
+
+    return clock;
+}
+
+static void ext_sectors(uint8_t clock, uint8_t write) {
+    uint32_t addr;
+    uint16_t count;
+    uint8_t flags, status, resp, ahead;
+
+    clock = ext_receive(clock, 7);
+    addr = ((uint32_t)ext_buf[0] << 24) | ((uint32_t)ext_buf[1] << 16) | ((uint16_t)ext_buf[2] << 8) | ext_buf[3];
+    count = (ext_buf[4] << 8) | ext_buf[5];
+    flags = ext_buf[6];
+    notify = flags & SECTORS_NOTIFY;
+
+    // Reads of an open transfer may go on beyond count, the rest is kept for the next command
+    ahead = !write && prefetch && (flags & SECTORS_MULTI) && !(flags & SECTORS_CLOSE);
+
+    if (write || (flags & SECTORS_OPEN))
+        ring_drop();
+    ring.prefetched = ring.ready + ring.job;
+
+    status = 0;
+    if (flags & SECTORS_OPEN) {
+        if (write && (flags & SECTORS_PREERASE)) {
+            if (sd_command(CMD55, 0) <= 1)
+                sd_command(CMD23, count);                                       // Only a hint, R1 ignored
+        }
+        if (write)
+            status = sd_command((flags & SECTORS_MULTI) ? CMD25 : CMD24, addr);
+        else
+            status = sd_command((flags & SECTORS_MULTI) ? CMD18 : CMD17, addr);
+    }
+
+    if (status == 0 && write && (flags & SECTORS_BUFFERED) && count > 1) {
+        uint8_t cur = 0;
+
+        card.state = CARD_DONE;
+        card.status = 0;
+        card.token = 0xfc;
+
+        while (count) {
+            count--;
+            clock = ext_write_buffer(clock, sector_buf[cur]);
+            card_finish();
+            if (card.status) {
+                status = card.status;
+                break;
+            }
+            card_start(CARD_READY, sector_buf[cur]);
+            cur ^= 1;
+        }
+
+        card_finish();
+        if (status == 0)
+            status = card.status;
+        count = 0;
+    }
+
+    if (status == 0 && !write && (ahead || ring.prefetched || ring.error || ((flags & SECTORS_BUFFERED) && count > 1))) {
+        card_resume();
+
+        while (count) {
+            ring_collect();
+            ring_fill(ahead || count > ring.ready);
+            if (!ring.ready) {
+                if (!ring.job) {
+                    status = ring.error;
+                    break;
+                }
+                card_finish();
+                continue;
+            }
+            if (ring.prefetched) {
+                ring.prefetched--;
+                prefetch_hits++;
+            }
+            clock = ext_read_buffer(clock, sector_buf[ring.head]);
+            ring.head ^= 1;
+            ring.ready--;
+            count--;
+        }
+
+        if (status || !ahead) {
+            ring_drop();                                                        // Sectors read ahead beyond count
+        } else {
+            ring_collect();
+            ring_fill(1);
+        }
+    }
+
+    while (status == 0 && count) {
+        count--;
+        if (write) {
+            if (spi_wait(1, CARD_TIMEOUT_MS) != 0xff) {
+                status = 0xff;
+                break;
+            }
+            clock = ext_write_block(clock, (flags & SECTORS_MULTI) ? 0xfc : 0xfe);
+            resp = spi_xfer(0xff);
+            if ((resp & 0x1f) != 0x05)
+                status = resp;
+        } else {
+            status = spi_wait(0, CARD_TIMEOUT_MS);
+            if (status != 0xfe)
+                break;
+            clock = ext_read_block(clock);
+            status = 0;
+        }
+    }
+
+    if (status == 0 && (flags & SECTORS_MULTI) && (flags & SECTORS_CLOSE)) {
+        if (write) {
+            if (spi_wait(1, CARD_TIMEOUT_MS) == 0xff)
+                spi_xfer(0xfd);                                                 // STOP_TRAN
+            else
+                status = 0xff;
+        } else {
+            status = sd_command(CMD12, 0);
+        }
+    }
+
+    ext_buf[0] = status;
+    ext_reply(clock, 1);
+    notify = 0;
+}
+
+// PREFETCH: one parameter byte, 0 (off), 1 (on) or 2 (unchanged). Replies with the number of
+// sectors read ahead that were used (hits) and dropped (misses) since the last PREFETCH, two
+// bytes each, most significant first.
+static void ext_prefetch(uint8_t clock) {
+    clock = ext_receive(clock, 1);
+    if (ext_buf[0] < 2)
+        prefetch = ext_buf[0];
+
+    ext_buf[0] = prefetch_hits >> 8;
+    ext_buf[1] = prefetch_hits;
+    ext_buf[2] = prefetch_misses >> 8;
+    ext_buf[3] = prefetch_misses;
+    prefetch_hits = 0;
+    prefetch_misses = 0;
+
+    ext_reply(clock, 4);
+}
+
+// QUERY: one reserved byte (0xff, which firmware without QUERY ignores as a command). Replies
+// with QUERY_MAGIC, FIRMWARE_VERSION and FIRMWARE_CAPS.
+static void ext_query(uint8_t clock) {
+    clock = ext_receive(clock, 1);
+
+    ext_buf[0] = QUERY_MAGIC;
+    ext_buf[1] = FIRMWARE_VERSION;
+    ext_buf[2] = FIRMWARE_CAPS;
+    ext_reply(clock, 3);
+}
+
 // ISR called on every a state change at PB0/CD'
 ISR(PCINT0_vect) {
     if(PINB & (1 << CD_BIT))                                                    // Invert and propagate CD' bit to ACK interrupt line.
@@ -68,12 +775,29 @@ int main() {
     SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);                // SPI enabled, master, fosc/64 = 250 kHz   <= Isn't this fosc/128 when SPR0=1 && SPR1=1 ???
     SPSR |= (1 << SPI2X);                                                       // SPI is doubled when the SPI is in Master mode.
 
+#ifdef USART_MODE
+    // USART0 in master SPI mode, SPI mode 0, MSB first, fosc/64 = 250 kHz; the SPI pins are unused
+    SPCR = 0;
+    UBRR0 = 0;                                                                  // Must be zero while the transmitter is enabled
+    DDRD = DDRD_SPI;                                                            // XCK0 as OUTPUT selects master mode
+    UCSR0C = (1 << UMSEL01) | (1 << UMSEL00);
+    UCSR0B = (1 << RXEN0) | (1 << TXEN0);
+    SPI_SLOW();
+#endif
+
     DDRC = 0;                                                                   
     PORTC = 0;                                                                  
 
-    DDRD = (1 << IDLE_BIT);                                                     
+    DDRD = DDRD_SPI | (1 << IDLE_BIT);                                          
     PORTD = 0;                                                                  
 
+#ifdef STROBE_MODE
+    EICRA = (1 << ISC01);                                                       // INTF0 set on falling edge of STROBE, interrupt stays disabled
+#endif
+
+    TCCR1A = 0;
+    TCCR1B = (1 << CS12) | (1 << CS10);                                         // Timer 1 at fosc/1024
+
     // Configure interrupts
     PCICR |= (1 << PCIE0);                                                      // Set PCIE0 (enables PCINT0..7) to enable PCMSK0 scan
     PCMSK0 |= (1 << PCINT0);                                                    // Enable PCINT0 (PB0/D8) to trigger an interrupt on any state change
@@ -87,6 +811,11 @@ int main() {
 
 main_loop:
 
+    if (ring.job)
+        prefetch_idle();
+
+main_loop_wait:
+
     if (PIND & (1 << CLOCK_BIT))                                            
         while (PIND & (1 << CLOCK_BIT));                                        
     else
@@ -101,6 +830,15 @@ main_loop:
 
     pin_c = PINC;                                                               
     pin_d = PIND;                                                               
+
+    // Only READ_SECTORS continues from the read ahead. 0xff is the undriven bus: a toggle of
+    // wait_until_idle() that crossed BUSY dropping, a no-op that must not end the open CMD18.
+    // BUSY stays low for it, as the Amiga may already have seen it low and sent the command
+    // next; the read ahead resumes after that command.
+    if ((pin_c & 0b00111111) == 0b00111111 && (pin_d & 0b01000000))
+        goto main_loop_wait;
+    if ((pin_c & 0b00111111) != OP_READ_SECTORS)
+        ring_drop();
     
     // READ2 or WRITE2
     if (!(pin_d & 0b01000000)) {                                                
@@ -123,9 +861,55 @@ main_loop:
 
     } else if ((pin_c & 0b00111110) == 0) {                                     
         if (pin_c & 1)                                                          
-            SPCR = (1 << SPE) | (1 << MSTR);
+            SPI_FAST();
         else                                                                    
-            SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
+            SPI_SLOW();
+    } else if ((pin_c & 0b00111111) == OP_COMMAND) {
+        PORTD = (1 << IDLE_BIT);
+        ext_command(pin_d & (1 << CLOCK_BIT));
+    } else if ((pin_c & 0b00111111) == OP_WAIT_TOKEN) {
+        PORTD = (1 << IDLE_BIT);
+        ext_wait(pin_d & (1 << CLOCK_BIT), 0);
+    } else if ((pin_c & 0b00111111) == OP_WAIT_READY) {
+        PORTD = (1 << IDLE_BIT);
+        ext_wait(pin_d & (1 << CLOCK_BIT), 1);
+    } else if ((pin_c & 0b00111111) == OP_READ_SECTORS) {
+        PORTD = (1 << IDLE_BIT);
+        ext_sectors(pin_d & (1 << CLOCK_BIT), 0);
+    } else if ((pin_c & 0b00111111) == OP_WRITE_SECTORS) {
+        PORTD = (1 << IDLE_BIT);
+        ext_sectors(pin_d & (1 << CLOCK_BIT), 1);
+    } else if ((pin_c & 0b00111111) == OP_PREFETCH) {
+        PORTD = (1 << IDLE_BIT);
+        ext_prefetch(pin_d & (1 << CLOCK_BIT));
+    } else if ((pin_c & 0b00111111) == OP_QUERY) {
+        PORTD = (1 << IDLE_BIT);
+        ext_query(pin_d & (1 << CLOCK_BIT));
+#ifdef STROBE_MODE
+    } else if ((pin_c & 0b00111110) == OP_STROBE_WRITE) {                       // STROBE_WRITE (0xc2) or STROBE_READ (0xc3), size - 1 follows as two bytes
+        if (pin_d & (1 << CLOCK_BIT))
+            while (PIND & (1 << CLOCK_BIT));
+        else
+            while (!(PIND & (1 << CLOCK_BIT)));
+
+        pin_d = PIND;
+        byte_count = ((pin_d & 0b11000000) | PINC) << 8;
+
+        if (pin_d & (1 << CLOCK_BIT))
+            while (PIND & (1 << CLOCK_BIT));
+        else
+            while (!(PIND & (1 << CLOCK_BIT)));
+
+        pin_d = PIND;
+        byte_count |= (pin_d & 0b11000000) | PINC;
+
+        EIFR = (1 << INTF0);                                                    // Forget the strobes caused by the command bytes
+
+        if (pin_c & 1)
+            goto do_strobe_read;
+        else
+            goto do_strobe_write;
+#endif
     }
 
     goto main_loop;
@@ -136,21 +920,21 @@ do_read1:
 
 do_read:
 
-    SPDR = 0b11111111;                                                          
+    SPI_DATA = 0b11111111;                                                      
 
     pin_d = PIND;                                                               
 
     PORTD = (pin_d & 0b11000000) | (1 << IDLE_BIT);                             
-    DDRD = 0b11000000 | (1 << IDLE_BIT);                                        
+    DDRD = DDRD_SPI | 0b11000000 | (1 << IDLE_BIT);                             
 
     PORTC = byte_count & 0b00111111;                                            
     DDRC = 0b00111111;                                                          
 
 read_loop:                                                                      
 
-    while (!(SPSR & (1 << SPIF)));
+    while (!SPI_DONE());
 
-    next_port_c = SPDR;
+    next_port_c = SPI_DATA;
     next_port_d = (next_port_c & 0b11000000) | (1 << IDLE_BIT);
 
     if (pin_d & (1 << CLOCK_BIT))
@@ -165,7 +949,7 @@ read_loop:
 
     if (byte_count) {
         byte_count--;
-        SPDR = 0b11111111;
+        SPI_DATA = 0b11111111;
         goto read_loop;
     }
 
@@ -174,7 +958,9 @@ read_loop:
     else
         while (!(PIND & (1 << CLOCK_BIT)));
 
-    DDRD = (1 << IDLE_BIT);
+    ring_drop();                                                                // The card has been used, READ1/WRITE1 skip the check above
+
+    DDRD = DDRD_SPI | (1 << IDLE_BIT);
     DDRC = 0;
 
     PORTD = 0;
@@ -199,20 +985,123 @@ write_loop:
         while (!(PIND & (1 << CLOCK_BIT)));                                     
 
     pin_d = PIND;
-    SPDR = (pin_d & 0b11000000) | PINC;
+#ifdef USART_MODE
+    SPI_QUEUE((pin_d & 0b11000000) | PINC);                                     // No wait, the next byte can follow back to back
+#else
+    SPI_DATA = (pin_d & 0b11000000) | PINC;
 
-    while (!(SPSR & (1 << SPIF)));
+    while (!SPI_DONE());
 
-    (void) SPDR;
+    (void) SPI_DATA;
+#endif
 
     if (byte_count) {
         byte_count--;
         goto write_loop;
     }
 
+#ifdef USART_MODE
+    usart_flush();
+#endif
+
+    ring_drop();
+
+    PORTD = 0;
+
+    goto main_loop;
+
+#ifdef STROBE_MODE
+do_strobe_read:
+
+    SPI_DATA = 0b11111111;
+    while (!SPI_DONE());
+    next_port_c = SPI_DATA;
+
+    PORTC = next_port_c;                                                        // First byte on the bus before BUSY goes high
+    DDRC = 0b00111111;
+    DDRD = DDRD_SPI | 0b11000000 | (1 << IDLE_BIT);
+    PORTD = (next_port_c & 0b11000000) | (1 << IDLE_BIT);
+
+strobe_read_loop:
+
+    if (!byte_count)
+        goto strobe_read_last;
+    byte_count--;
+
+    SPI_DATA = 0b11111111;                                                      // Fetch the next byte while the Amiga reads this one
+    while (!SPI_DONE());
+    next_port_c = SPI_DATA;
+    next_port_d = (next_port_c & 0b11000000) | (1 << IDLE_BIT);
+
+    STROBE_WAIT(strobe_read_end);
+    EIFR = (1 << INTF0);
+
+    PORTC = next_port_c;
+    PORTD = next_port_d;
+
+    goto strobe_read_loop;
+
+strobe_read_last:
+
+    STROBE_WAIT(strobe_read_end);
+    EIFR = (1 << INTF0);
+
+strobe_read_end:
+
+    DDRD = DDRD_SPI | (1 << IDLE_BIT);
+    DDRC = 0;
+
+    PORTD = 0;
+    PORTC = 0;
+
+    goto main_loop;
+
+do_strobe_write:
+
+    PORTD = (1 << IDLE_BIT);                                                    // Ready for the first strobe
+
+    STROBE_WAIT(strobe_write_end);
+    EIFR = (1 << INTF0);
+#ifdef USART_MODE
+    SPI_QUEUE((PIND & 0b11000000) | PINC);
+#else
+    SPI_DATA = (PIND & 0b11000000) | PINC;
+#endif
+
+strobe_write_loop:
+
+    if (!byte_count)
+        goto strobe_write_last;
+    byte_count--;
+
+    STROBE_WAIT(strobe_write_last);
+    EIFR = (1 << INTF0);
+    next_port_c = (PIND & 0b11000000) | PINC;                                   // Latch the byte before the Amiga can change it
+
+#ifdef USART_MODE
+    SPI_QUEUE(next_port_c);
+#else
+    while (!SPI_DONE());
+    SPI_DATA = next_port_c;
+#endif
+
+    goto strobe_write_loop;
+
+strobe_write_last:
+
+#ifdef USART_MODE
+    usart_flush();
+#else
+    while (!SPI_DONE());
+    (void) SPI_DATA;
+#endif
+
+strobe_write_end:
+
     PORTD = 0;
 
     goto main_loop;
+#endif
 
     return 0;
 